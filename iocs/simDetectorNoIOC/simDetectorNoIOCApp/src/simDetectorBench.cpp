@@ -0,0 +1,734 @@
+/* simDetectorBench.cpp
+ *
+ * Throughput benchmark for the simDetector, run outside an IOC.
+ *
+ * For each combination of simulation mode, data type, color mode, image size and region of interest it acquires
+ * images at the maximum rate for a fixed time, and writes the frame rate, data rate and frame time percentiles to
+ * a CSV file.  The results are the reference for finding performance regressions between releases.
+ *
+ * With -g or -c it instead checks that the images do not change.  For each combination of simulation mode, data
+ * type, color mode, noise type and region of interest, including binning and reversal, it acquires a few images
+ * with fixed parameters and computes a hash of them.  With the None noise type, which has no noise and no peak
+ * height variation, it also acquires them through the queue, the replay ring, batches, sub-frames and a change of
+ * the region during the acquisition, which must not change them.  -g writes the hashes to a golden file, and -c
+ * compares them with those in one or more files, once for each instruction set supported by the CPU with 1 thread
+ * and again with several threads.
+ *
+ * simDetectorGolden.txt in this directory has the hashes written with -g, with the scalar kernels and 1 thread.
+ * Those with noise were written by the driver that introduced this check, before the changes to the scheduling
+ * and publishing of the images, and the None ones when they were added.  simDetectorGoldenR2-10.txt has the None
+ * hashes of the images of the R2-10 driver, whose noise came from rand(), computed without the driver's
+ * acquisition thread and combined as each scenario publishes them.  "make runtests" checks the driver against both.
+ *
+ * The hashes of the floating point images depend on the compiler, its flags and the C library, because they
+ * change the rounding.  The kernels are compiled with fp-contract off so that no multiply and add is fused on any
+ * instruction set, and the golden file was written with GCC on x86-64 Linux.  With that toolchain a hash that
+ * differs is a real change of the images, not rounding noise; on other systems write a golden file with -g from a
+ * known good version before checking a change.
+ *
+ * Usage: simDetectorBench [-d seconds] [-s size[,size...]] [-t threads] [-o file.csv]
+ *        simDetectorBench -g golden.txt|-c golden.txt [-c golden.txt...] [-s size[,size...]] [-t threads]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+#include <epicsGetopt.h>
+#include <asynPortClient.h>
+#include <simDetector.h>
+
+#ifndef EPICS_LIBCOM_ONLY
+  #include <dbAccess.h>
+#endif
+
+#define DEFAULT_DURATION 1.0
+#define DEFAULT_SIZES "1024,2048"
+#define MAX_SIZES 10
+#define STOP_TIMEOUT 10.0
+#define GOLDEN_SIZES "97"
+#define GOLDEN_THREADS 4
+#define GOLDEN_FRAMES 4
+
+static const struct {
+  int mode;
+  const char *name;
+} benchModes[] = {
+  {SimModeLinearRamp,  "LinearRamp"},
+  {SimModePeaks,       "Peaks"},
+  {SimModeSine,        "Sine"},
+  {SimModeOffsetNoise, "OffsetNoise"}
+};
+
+typedef struct {
+  NDDataType_t dataType;
+  const char *name;
+} benchDataType_t;
+
+static const benchDataType_t benchDataTypes[] = {
+  {NDUInt8,   "UInt8"},
+  {NDUInt16,  "UInt16"},
+  {NDUInt32,  "UInt32"},
+  {NDFloat32, "Float32"},
+  {NDFloat64, "Float64"}
+};
+
+static const benchDataType_t goldenDataTypes[] = {
+  {NDInt8,    "Int8"},
+  {NDUInt8,   "UInt8"},
+  {NDInt16,   "Int16"},
+  {NDUInt16,  "UInt16"},
+  {NDInt32,   "Int32"},
+  {NDUInt32,  "UInt32"},
+  {NDInt64,   "Int64"},
+  {NDUInt64,  "UInt64"},
+  {NDFloat32, "Float32"},
+  {NDFloat64, "Float64"}
+};
+
+typedef struct {
+  NDColorMode_t colorMode;
+  const char *name;
+} benchColorMode_t;
+
+static const benchColorMode_t benchColorModes[] = {
+  {NDColorModeMono, "Mono"},
+  {NDColorModeRGB1, "RGB1"},
+  {NDColorModeRGB3, "RGB3"}
+};
+
+static const benchColorMode_t goldenColorModes[] = {
+  {NDColorModeMono, "Mono"},
+  {NDColorModeRGB1, "RGB1"},
+  {NDColorModeRGB2, "RGB2"},
+  {NDColorModeRGB3, "RGB3"}
+};
+
+/* The noise types, with the noise and peak height variation.  None has neither, so its images can be compared with
+ * those of drivers whose noise came from rand(). */
+typedef struct {
+  int noiseType;
+  double noise;
+  double peakVariation;
+  const char *name;
+} goldenNoise_t;
+
+static const goldenNoise_t goldenNoiseTypes[] = {
+  {SimNoiseFixed,    10.0, 10.0, "Fixed"},
+  {SimNoiseGaussian, 10.0, 10.0, "Gaussian"},
+  {SimNoisePoisson,  10.0, 10.0, "Poisson"},
+  {SimNoiseFixed,     0.0,  0.0, "None"}
+};
+
+/* The regions of interest, as fractions of the image size, the binning and the reversal */
+typedef struct {
+  const char *name;
+  double min;
+  double size;
+  int binX;
+  int binY;
+  int reverse;
+} benchRegion_t;
+
+static const benchRegion_t benchRegions[] = {
+  {"Full",   0.0,  1.0, 1, 1, 0},
+  {"Center", 0.25, 0.5, 1, 1, 0},
+  {"Bin2x2", 0.0,  1.0, 2, 2, 0}
+};
+
+static const benchRegion_t goldenRegions[] = {
+  {"Full",             0.0,  1.0, 1, 1, 0},
+  {"Center",           0.25, 0.5, 1, 1, 0},
+  {"Bin2x2",           0.0,  1.0, 2, 2, 0},
+  {"Bin3x2Reverse",    0.1,  0.8, 3, 2, 1}
+};
+
+/* The ways of acquiring the images that must not change them, which are checked with the None noise type and the
+ * Full region.  Batch publishes GOLDEN_FRAMES / batchSize arrays of batchSize images, SubFrames publishes
+ * GOLDEN_FRAMES sums of subFrames images and ROIChange changes the region to pNewRegion without resetting the image
+ * after half of the images. */
+typedef struct {
+  const char *name;
+  int queueSize;
+  int replayFrames;
+  int batchSize;
+  int subFrames;
+  const benchRegion_t *pNewRegion;
+} goldenScenario_t;
+
+static const goldenScenario_t goldenScenarios[] = {
+  {"Queue",     4, 0, 1, 1, NULL},
+  {"Replay",    0, 2, 1, 1, NULL},
+  {"Batch",     0, 0, 2, 1, NULL},
+  {"SubFrames", 0, 0, 1, 2, NULL},
+  {"ROIChange", 0, 0, 1, 1, &goldenRegions[1]}
+};
+
+#define NUM_ELEMENTS(a) (sizeof(a) / sizeof((a)[0]))
+
+/** The results of one point of the benchmark */
+typedef struct {
+  int frames;           /* The number of images received after the first one */
+  double seconds;       /* The time from the first to the last image received */
+  double bytes;         /* The number of bytes in the images received after the first one */
+  double frameP50;      /* The median time between images in ms */
+  double frameP99;
+  double frameMax;
+  double computeP50;    /* The median time to compute an image in ms, from SIM_COMPUTE_TIME_P50 */
+  double computeP99;
+} benchResult_t;
+
+class simDetectorBench
+{
+public:
+  simDetectorBench(const char *portName, int size, int numThreads);
+  void run(int mode, int dataType, int colorMode, const benchRegion_t *pRegion, double duration,
+           benchResult_t *pResult);
+  int golden(int mode, int dataType, int colorMode, const goldenNoise_t *pNoise, const benchRegion_t *pRegion,
+             const goldenScenario_t *pScenario, epicsUInt64 *pHash);
+  void setKernel(int kernel, int numThreads);
+  void NDArrayCallback(NDArray *pArray);
+  const char *kernelName();
+
+private:
+  void setup(int mode, int dataType, int colorMode, const benchRegion_t *pRegion);
+  void setRegion(const benchRegion_t *pRegion);
+  void waitForIdle(double frameTime);
+  int hashImages(int numImages, int numArrays);
+  simDetector    *pSimDetector_;
+  asynPortClient *pSimClient_;
+  int size_;
+  epicsMutex lock_;
+  bool counting_;
+  epicsUInt64 lastTime_;
+  std::vector<double> frameTimes_;
+  double bytes_;
+  bool hashing_;
+  int hashFrames_;      /* The number of images in hash_ */
+  epicsUInt64 hash_;    /* The hash of the images received while hashing_ is true */
+};
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/** Returns the 64-bit FNV-1a hash of size bytes, continuing from hash */
+static epicsUInt64 fnvHash(epicsUInt64 hash, const void *pData, size_t size)
+{
+  const unsigned char *pBytes = (const unsigned char *)pData;
+  size_t i;
+
+  for (i=0; i<size; i++) {
+    hash ^= pBytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static void NDArrayCallbackC(void *drvPvt, asynUser *pasynUser, void *pData)
+{
+  simDetectorBench *pBench = (simDetectorBench *)drvPvt;
+  pBench->NDArrayCallback((NDArray *)pData);
+}
+
+/** Records the time since the previous image.  The first image of each point is not counted, because its time
+  * includes the reset of the image. */
+void simDetectorBench::NDArrayCallback(NDArray *pArray)
+{
+  epicsUInt64 now = epicsMonotonicGet();
+  NDArrayInfo_t arrayInfo;
+
+  lock_.lock();
+  if (counting_) {
+    if (lastTime_) {
+      pArray->getInfo(&arrayInfo);
+      frameTimes_.push_back((now - lastTime_) * 1.e-6);
+      bytes_ += arrayInfo.totalBytes;
+    }
+    lastTime_ = now;
+  }
+  if (hashing_) {
+    NDAttribute *pAttribute = pArray->pAttributeList->find("ColorMode");
+    epicsInt32 colorMode = -1;
+    int i;
+
+    // The data, the dimensions, the data type and the color mode attribute
+    pArray->getInfo(&arrayInfo);
+    if (pAttribute) pAttribute->getValue(NDAttrInt32, &colorMode);
+    hash_ = fnvHash(hash_, pArray->pData, arrayInfo.totalBytes);
+    for (i=0; i<pArray->ndims; i++) {
+      epicsUInt64 size = pArray->dims[i].size;
+      hash_ = fnvHash(hash_, &size, sizeof(size));
+    }
+    hash_ = fnvHash(hash_, &pArray->dataType, sizeof(pArray->dataType));
+    hash_ = fnvHash(hash_, &colorMode, sizeof(colorMode));
+    hashFrames_++;
+  }
+  lock_.unlock();
+}
+
+simDetectorBench::simDetectorBench(const char *portName, int size, int numThreads)
+  : size_(size), counting_(false), lastTime_(0), bytes_(0.), hashing_(false), hashFrames_(0), hash_(0)
+{
+  pSimDetector_ = new simDetector(portName, size, size, NDUInt8, 0, 0, 0, 0);
+  pSimClient_   = new asynPortClient(portName);
+  pSimClient_->write(NDArrayCallbacksString, 1);            // Enable NDArray callbacks
+  pSimClient_->write(ADImageModeString, ADImageContinuous); // Acquire until stopped
+  pSimClient_->write(ADAcquireTimeString, 0.0);             // Acquire at the maximum rate
+  pSimClient_->write(ADAcquirePeriodString, 0.0);
+  pSimClient_->write(SimNumThreadsString, numThreads);
+  pSimClient_->write(ADGainString, 1.0);
+  pSimClient_->write(SimNoiseString, 10.0);                 // Offset and noise for the background
+  pSimClient_->write(SimOffsetString, 10.0);
+  pSimClient_->write(SimPeakStartXString, size / 20);       // 10x10 peaks over the image
+  pSimClient_->write(SimPeakStartYString, size / 20);
+  pSimClient_->write(SimPeakStepXString, size / 10);
+  pSimClient_->write(SimPeakStepYString, size / 10);
+  pSimClient_->write(SimPeakNumXString, 10);
+  pSimClient_->write(SimPeakNumYString, 10);
+  pSimClient_->write(SimPeakWidthXString, size / 100 + 1);
+  pSimClient_->write(SimPeakWidthYString, size / 100 + 1);
+  pSimClient_->write(SimXSine1AmplitudeString, 100.0);      // Sine waves in X and Y
+  pSimClient_->write(SimXSine1FrequencyString, 5.0);
+  pSimClient_->write(SimYSine1AmplitudeString, 100.0);
+  pSimClient_->write(SimYSine1FrequencyString, 3.0);
+  pSimClient_->write(SimXSine2AmplitudeString, 50.0);
+  pSimClient_->write(SimXSine2FrequencyString, 2.0);
+  pSimClient_->write(SimXSine2PhaseString, 30.0);
+  pSimClient_->write(SimYSine2AmplitudeString, 20.0);
+  pSimClient_->write(SimYSine2FrequencyString, 7.0);
+  pSimClient_->write(SimYSine2PhaseString, 45.0);
+  pSimClient_->write(SimPeakHeightVariationString, 10.0);
+  pSimClient_->write(SimNoiseSeedString, 1);
+
+  asynGenericPointerClient *pNDArray = (asynGenericPointerClient*)pSimClient_->getParamClient(NDArrayDataString);
+  pNDArray->registerInterruptUser(NDArrayCallbackC, this);
+}
+
+const char *simDetectorBench::kernelName()
+{
+  int kernel;
+
+  pSimClient_->read(SimSIMDKernelString, &kernel);
+  return simKernelsName((SimKernel_t)kernel);
+}
+
+/** Selects the instruction set and the number of threads used to compute the images */
+void simDetectorBench::setKernel(int kernel, int numThreads)
+{
+  pSimClient_->write(SimSIMDKernelString, kernel);
+  pSimClient_->write(SimNumThreadsString, numThreads);
+}
+
+/** Sets the parameters of one point of the benchmark */
+void simDetectorBench::setup(int mode, int dataType, int colorMode, const benchRegion_t *pRegion)
+{
+  pSimClient_->write(SimModeString, mode);
+  pSimClient_->write(NDDataTypeString, dataType);
+  pSimClient_->write(NDColorModeString, colorMode);
+  setRegion(pRegion);
+}
+
+/** Sets the region of interest, the binning and the reversal */
+void simDetectorBench::setRegion(const benchRegion_t *pRegion)
+{
+  int min = (int)(pRegion->min * size_);
+  int regionSize = (int)(pRegion->size * size_);
+
+  pSimClient_->write(ADMinXString, min);
+  pSimClient_->write(ADMinYString, min);
+  pSimClient_->write(ADSizeXString, regionSize);
+  pSimClient_->write(ADSizeYString, regionSize);
+  pSimClient_->write(ADBinXString, pRegion->binX);
+  pSimClient_->write(ADBinYString, pRegion->binY);
+  pSimClient_->write(ADReverseXString, pRegion->reverse);
+  pSimClient_->write(ADReverseYString, pRegion->reverse);
+}
+
+/** Waits until the driver has finished the last image, so that it is not counted in the next point.
+  * \param[in] frameTime The longest time between images in ms. */
+void simDetectorBench::waitForIdle(double frameTime)
+{
+  int counter, previousCounter;
+  double waited;
+
+  pSimClient_->read(NDArrayCounterString, &counter);
+  for (waited=0.; waited<STOP_TIMEOUT; ) {
+    previousCounter = counter;
+    epicsThreadSleep(frameTime * 1.e-3 + 0.01);
+    waited += frameTime * 1.e-3 + 0.01;
+    pSimClient_->read(NDArrayCounterString, &counter);
+    if (counter == previousCounter) break;
+  }
+}
+
+/** Acquires images for one point of the benchmark for duration seconds */
+void simDetectorBench::run(int mode, int dataType, int colorMode, const benchRegion_t *pRegion, double duration,
+                           benchResult_t *pResult)
+{
+  size_t n;
+
+  setup(mode, dataType, colorMode, pRegion);
+  pSimClient_->write(ADImageModeString, ADImageContinuous);
+
+  lock_.lock();
+  frameTimes_.clear();
+  bytes_ = 0.;
+  lastTime_ = 0;
+  counting_ = true;
+  lock_.unlock();
+
+  pSimClient_->write(ADAcquireString, 1);
+  epicsThreadSleep(duration);
+  lock_.lock();
+  counting_ = false;
+  lock_.unlock();
+  pSimClient_->write(ADAcquireString, 0);
+
+  memset(pResult, 0, sizeof(*pResult));
+  n = frameTimes_.size();
+  pResult->frames = (int)n;
+  pResult->bytes = bytes_;
+  if (n > 0) {
+    for (size_t i=0; i<n; i++) pResult->seconds += frameTimes_[i] * 1.e-3;
+    std::sort(frameTimes_.begin(), frameTimes_.end());
+    pResult->frameP50 = frameTimes_[n/2];
+    pResult->frameP99 = frameTimes_[(99*n + 99)/100 - 1];
+    pResult->frameMax = frameTimes_[n-1];
+  }
+
+  waitForIdle(pResult->frameMax);
+  pSimClient_->read(SimComputeTimeP50String, &pResult->computeP50);
+  pSimClient_->read(SimComputeTimeP99String, &pResult->computeP99);
+}
+
+/** Acquires numImages images and adds them to the hash, waiting until numArrays arrays have been received and the
+  * driver has stopped.
+  * \return 0 if the arrays were received, -1 if not. */
+int simDetectorBench::hashImages(int numImages, int numArrays)
+{
+  double waited;
+  int frames, acquiring;
+
+  pSimClient_->write(ADImageModeString, ADImageMultiple);
+  pSimClient_->write(ADNumImagesString, numImages);
+  lock_.lock();
+  hashFrames_ = 0;
+  hashing_ = true;
+  lock_.unlock();
+
+  pSimClient_->write(ADAcquireString, 1);
+  for (waited=0.; waited<STOP_TIMEOUT; waited+=0.001) {
+    lock_.lock();
+    frames = hashFrames_;
+    lock_.unlock();
+    if (frames >= numArrays) break;
+    epicsThreadSleep(0.001);
+  }
+  lock_.lock();
+  hashing_ = false;
+  lock_.unlock();
+  // The driver stops by itself after the last image
+  for (waited=0.; waited<STOP_TIMEOUT; waited+=0.001) {
+    pSimClient_->read(ADAcquireString, &acquiring);
+    if (!acquiring) break;
+    epicsThreadSleep(0.001);
+  }
+  if (acquiring) pSimClient_->write(ADAcquireString, 0);
+  return ((frames == numArrays) && !acquiring) ? 0 : -1;
+}
+
+/** Acquires GOLDEN_FRAMES images from the start of the simulation with the parameters of one point, and returns
+  * the hash of them.
+  * \param[in] pScenario The way the images are acquired, or NULL to acquire them one at a time without a queue.
+  * \return 0 if the images were received, -1 if not. */
+int simDetectorBench::golden(int mode, int dataType, int colorMode, const goldenNoise_t *pNoise,
+                             const benchRegion_t *pRegion, const goldenScenario_t *pScenario, epicsUInt64 *pHash)
+{
+  int status;
+
+  setup(mode, dataType, colorMode, pRegion);
+  pSimClient_->write(SimNoiseTypeString, pNoise->noiseType);
+  pSimClient_->write(SimNoiseString, pNoise->noise);
+  pSimClient_->write(SimPeakHeightVariationString, pNoise->peakVariation);
+  if (pScenario) {
+    pSimClient_->write(SimQueueSizeString, pScenario->queueSize);
+    pSimClient_->write(SimReplayFramesString, pScenario->replayFrames);
+    pSimClient_->write(SimBatchSizeString, pScenario->batchSize);
+    pSimClient_->write(SimSubFramesString, pScenario->subFrames);
+  }
+  pSimClient_->write(SimResetImageString, 1);
+
+  lock_.lock();
+  hash_ = FNV_OFFSET_BASIS;
+  lock_.unlock();
+  if (pScenario && pScenario->pNewRegion) {
+    status = hashImages(GOLDEN_FRAMES/2, GOLDEN_FRAMES/2);
+    setRegion(pScenario->pNewRegion);
+    if (!status) status = hashImages(GOLDEN_FRAMES/2, GOLDEN_FRAMES/2);
+  } else {
+    status = hashImages(GOLDEN_FRAMES, pScenario ? GOLDEN_FRAMES/pScenario->batchSize : GOLDEN_FRAMES);
+  }
+  lock_.lock();
+  *pHash = hash_;
+  lock_.unlock();
+
+  if (pScenario) {
+    pSimClient_->write(SimQueueSizeString, 0);
+    pSimClient_->write(SimReplayFramesString, 0);
+    pSimClient_->write(SimBatchSizeString, 1);
+    pSimClient_->write(SimSubFramesString, 1);
+  }
+  return status;
+}
+
+typedef std::map<std::string, epicsUInt64> goldenHashes_t;
+
+/** Either adds the hash of one point to pHashes or compares it with the one in pHashes.
+  * \return 1 if the hash differs from pHashes, 0 if not. */
+static int checkHash(const char *key, epicsUInt64 hash, goldenHashes_t *pHashes, bool compare)
+{
+  goldenHashes_t::iterator it;
+
+  if (!compare) {
+    (*pHashes)[key] = hash;
+    return 0;
+  }
+  it = pHashes->find(key);
+  if (it == pHashes->end()) {
+    fprintf(stderr, "%s: not in the golden file\n", key);
+    return 1;
+  }
+  if (it->second != hash) {
+    fprintf(stderr, "%s: hash %016llx, golden %016llx\n", key, (unsigned long long)hash,
+            (unsigned long long)it->second);
+    return 1;
+  }
+  return 0;
+}
+
+/** Computes the hashes of the images of every point of the golden check for one size, and either adds them to
+  * pHashes or compares them with those in pHashes.  The scenarios are checked with the None noise type, the last
+  * one, and the Full region, the first one.
+  * \return The number of points whose images differ from pHashes or were not received. */
+static int runGolden(simDetectorBench *pBench, int size, goldenHashes_t *pHashes, bool compare)
+{
+  const goldenNoise_t *pNoneNoise = &goldenNoiseTypes[NUM_ELEMENTS(goldenNoiseTypes) - 1];
+  char key[100];
+  epicsUInt64 hash;
+  int errors = 0;
+  size_t m, t, c, n, r;
+
+  for (m=0; m<NUM_ELEMENTS(benchModes); m++) {
+    for (t=0; t<NUM_ELEMENTS(goldenDataTypes); t++) {
+      for (c=0; c<NUM_ELEMENTS(goldenColorModes); c++) {
+        for (n=0; n<NUM_ELEMENTS(goldenNoiseTypes); n++) {
+          for (r=0; r<NUM_ELEMENTS(goldenRegions); r++) {
+            epicsSnprintf(key, sizeof(key), "%d %s %s %s %s %s", size, benchModes[m].name,
+                          goldenDataTypes[t].name, goldenColorModes[c].name, goldenNoiseTypes[n].name,
+                          goldenRegions[r].name);
+            if (pBench->golden(benchModes[m].mode, goldenDataTypes[t].dataType, goldenColorModes[c].colorMode,
+                               &goldenNoiseTypes[n], &goldenRegions[r], NULL, &hash)) {
+              fprintf(stderr, "%s: timeout waiting for the images\n", key);
+              errors++;
+              continue;
+            }
+            errors += checkHash(key, hash, pHashes, compare);
+          }
+        }
+        for (n=0; n<NUM_ELEMENTS(goldenScenarios); n++) {
+          epicsSnprintf(key, sizeof(key), "%d %s %s %s %s %s %s", size, benchModes[m].name,
+                        goldenDataTypes[t].name, goldenColorModes[c].name, pNoneNoise->name, goldenRegions[0].name,
+                        goldenScenarios[n].name);
+          if (pBench->golden(benchModes[m].mode, goldenDataTypes[t].dataType, goldenColorModes[c].colorMode,
+                             pNoneNoise, &goldenRegions[0], &goldenScenarios[n], &hash)) {
+            fprintf(stderr, "%s: timeout waiting for the images\n", key);
+            errors++;
+            continue;
+          }
+          errors += checkHash(key, hash, pHashes, compare);
+        }
+      }
+    }
+  }
+  return errors;
+}
+
+/** Compares the hashes of the images computed with one instruction set and number of threads with pHashes.
+  * \return The number of points whose images differ. */
+static int checkGolden(simDetectorBench *pBench, int size, int kernel, int numThreads, goldenHashes_t *pHashes)
+{
+  int errors;
+
+  pBench->setKernel(kernel, numThreads);
+  printf("Size %d, %s kernel, %d thread(s): ", size, pBench->kernelName(), numThreads);
+  fflush(stdout);
+  errors = runGolden(pBench, size, pHashes, true);
+  printf("%d differences\n", errors);
+  return errors;
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: simDetectorBench [-d seconds] [-s size[,size...]] [-t threads] [-o file.csv]\n"
+                  "       simDetectorBench -g golden.txt|-c golden.txt [-c golden.txt...] [-s size[,size...]]"
+                  " [-t threads]\n"
+                  "  -d  Time to acquire for each point (default %g s)\n"
+                  "  -s  Image sizes, each one is size x size pixels (default %s, or %s with -g and -c)\n"
+                  "  -t  Number of threads used to compute each image (default 1, or %d with -c)\n"
+                  "  -o  CSV output file (default stdout)\n"
+                  "  -g  Write the hashes of the images to a golden file\n"
+                  "  -c  Compare the hashes of the images with golden files, for each instruction set\n"
+                  "      with 1 thread and with the number of threads of -t.  A point in more than one\n"
+                  "      file has the hash of the last one, and every point must be in one of them.\n",
+          DEFAULT_DURATION, DEFAULT_SIZES, GOLDEN_SIZES, GOLDEN_THREADS);
+}
+
+int main(int argc, char **argv)
+{
+  double duration = DEFAULT_DURATION;
+  const char *sizeList = NULL;
+  const char *fileName = NULL;
+  const char *goldenFile = NULL;
+  std::vector<const char *> compareFiles;
+  bool compare = false;
+  int numThreads = 0;
+  int sizes[MAX_SIZES];
+  int numSizes = 0;
+  char portName[20];
+  char *sizeString, *token;
+  FILE *fp = stdout;
+  benchResult_t result;
+  goldenHashes_t hashes;
+  char line[200];
+  unsigned long long hash;
+  int errors = 0;
+  int opt, s, kernel;
+  size_t m, t, c, r;
+
+  while ((opt = getopt(argc, argv, "d:s:t:o:g:c:h")) != -1) {
+    switch (opt) {
+      case 'd': duration = atof(optarg); break;
+      case 's': sizeList = optarg; break;
+      case 't': numThreads = atoi(optarg); break;
+      case 'o': fileName = optarg; break;
+      case 'g': goldenFile = optarg; compare = false; break;
+      case 'c': goldenFile = optarg; compare = true; compareFiles.push_back(optarg); break;
+      default:  usage(); return 1;
+    }
+  }
+  if (!sizeList) sizeList = goldenFile ? GOLDEN_SIZES : DEFAULT_SIZES;
+  if (numThreads == 0) numThreads = compare ? GOLDEN_THREADS : 1;
+  sizeString = epicsStrDup(sizeList);
+  for (token = strtok(sizeString, ","); token && (numSizes < MAX_SIZES); token = strtok(NULL, ",")) {
+    sizes[numSizes] = atoi(token);
+    if (sizes[numSizes] > 0) numSizes++;
+  }
+  free(sizeString);
+  if ((numSizes == 0) || (duration <= 0.) || (numThreads < 1)) {
+    usage();
+    return 1;
+  }
+
+#ifndef EPICS_LIBCOM_ONLY
+  // Must set this for callbacks to work if EPICS_LIBCOM_ONLY is not defined
+  interruptAccept = 1;
+#endif
+
+  if (goldenFile && compare) {
+    // A point in more than one file has the hash of the last one
+    for (size_t f=0; f<compareFiles.size(); f++) {
+      fp = fopen(compareFiles[f], "r");
+      if (!fp) {
+        perror(compareFiles[f]);
+        return 1;
+      }
+      while (fgets(line, sizeof(line), fp)) {
+        char *pHash = strrchr(line, ' ');
+        if ((line[0] == '#') || !pHash) continue;
+        *pHash = 0;
+        if (sscanf(pHash + 1, "%llx", &hash) == 1) hashes[line] = hash;
+      }
+      fclose(fp);
+    }
+    // Every instruction set with 1 thread, then the fastest one with numThreads
+    for (s=0; s<numSizes; s++) {
+      epicsSnprintf(portName, sizeof(portName), "GOLDEN%d", s+1);
+      simDetectorBench bench(portName, sizes[s], 1);
+      for (kernel=SimKernelScalar; kernel<=simKernelsDetect(); kernel++) {
+        errors += checkGolden(&bench, sizes[s], kernel, 1, &hashes);
+      }
+      if (numThreads > 1) {
+        errors += checkGolden(&bench, sizes[s], simKernelsDetect(), numThreads, &hashes);
+      }
+    }
+    printf("%s\n", errors ? "FAILED" : "PASSED");
+    return errors ? 1 : 0;
+  }
+  if (goldenFile) {
+    // The golden hashes are computed with the scalar kernels and 1 thread
+    for (s=0; s<numSizes; s++) {
+      epicsSnprintf(portName, sizeof(portName), "GOLDEN%d", s+1);
+      simDetectorBench bench(portName, sizes[s], 1);
+      bench.setKernel(SimKernelScalar, 1);
+      errors += runGolden(&bench, sizes[s], &hashes, false);
+    }
+    if (errors) return 1;
+    fp = fopen(goldenFile, "w");
+    if (!fp) {
+      perror(goldenFile);
+      return 1;
+    }
+    fprintf(fp, "# simDetector golden image hashes: size mode data_type color_mode noise_type region [scenario] hash\n");
+    for (goldenHashes_t::iterator it=hashes.begin(); it!=hashes.end(); it++) {
+      fprintf(fp, "%s %016llx\n", it->first.c_str(), (unsigned long long)it->second);
+    }
+    fclose(fp);
+    printf("Wrote %d hashes to %s\n", (int)hashes.size(), goldenFile);
+    return 0;
+  }
+
+  if (fileName) {
+    fp = fopen(fileName, "w");
+    if (!fp) {
+      perror(fileName);
+      return 1;
+    }
+  }
+
+  fprintf(fp, "size,mode,data_type,color_mode,region,threads,kernel,frames,seconds,"
+              "frames_per_s,GB_per_s,frame_ms_p50,frame_ms_p99,frame_ms_max,compute_ms_p50,compute_ms_p99\n");
+  for (s=0; s<numSizes; s++) {
+    // Each size needs its own driver, because the maximum size is set when it is created
+    epicsSnprintf(portName, sizeof(portName), "BENCH%d", s+1);
+    simDetectorBench bench(portName, sizes[s], numThreads);
+    for (m=0; m<NUM_ELEMENTS(benchModes); m++) {
+      for (t=0; t<NUM_ELEMENTS(benchDataTypes); t++) {
+        for (c=0; c<NUM_ELEMENTS(benchColorModes); c++) {
+          for (r=0; r<NUM_ELEMENTS(benchRegions); r++) {
+            bench.run(benchModes[m].mode, benchDataTypes[t].dataType, benchColorModes[c].colorMode,
+                      &benchRegions[r], duration, &result);
+            fprintf(fp, "%d,%s,%s,%s,%s,%d,%s,%d,%.3f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                    sizes[s], benchModes[m].name, benchDataTypes[t].name, benchColorModes[c].name,
+                    benchRegions[r].name, numThreads, bench.kernelName(), result.frames, result.seconds,
+                    (result.seconds > 0.) ? result.frames / result.seconds : 0.,
+                    (result.seconds > 0.) ? result.bytes / result.seconds / 1.e9 : 0.,
+                    result.frameP50, result.frameP99, result.frameMax, result.computeP50, result.computeP99);
+            fflush(fp);
+          }
+        }
+      }
+    }
+  }
+  if (fp != stdout) fclose(fp);
+  return 0;
+}
@@ -0,0 +1,14 @@
+#!/usr/bin/env perl
+
+# Checks that the simDetector images are unchanged, by comparing their hashes with those in simDetectorGolden.txt
+# with each instruction set supported by the CPU and with several threads.  The noise-free images must also be
+# those of the R2-10 driver in simDetectorGoldenR2-10.txt, which is given last so that its hashes are used.
+
+use strict;
+use warnings;
+
+my $bench = ($^O =~ /^(MSWin32|cygwin)$/) ? 'simDetectorBench.exe' : './simDetectorBench';
+
+print "1..1\n";
+my $status = system($bench, '-c', '../simDetectorGolden.txt', '-c', '../simDetectorGoldenR2-10.txt');
+print(($status == 0 ? 'ok' : 'not ok'), " 1 - simDetectorBench -c simDetectorGolden.txt -c simDetectorGoldenR2-10.txt\n");
@@ -0,0 +1,301 @@
+/* simDetectorKernelBench.cpp
+ *
+ * Microbenchmark for the kernels that compute the simDetector images.
+ *
+ * The inner loops of the LinearRamp, Peaks, Sine and Offset&Noise modes, the background copy, the binning and the
+ * sums of the sub-frames are the kernels in simDetectorKernels.h, which work on raw buffers.  This program calls
+ * each kernel one image row at a time, as the driver does, for each data type, each instruction set supported by
+ * the CPU and each image size, without creating a driver.  It writes the time per element and the bytes per CPU
+ * cycle to a CSV file, so that a change to one kernel can be measured without the noise of the whole driver.
+ *
+ * Usage: simDetectorKernelBench [-d seconds] [-s size[,size...]] [-f GHz] [-o file.csv]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsString.h>
+#include <epicsGetopt.h>
+#include <simDetectorKernels.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #include <x86intrin.h>
+  #define BENCH_HAS_TSC
+#endif
+
+#define DEFAULT_DURATION 0.2
+#define DEFAULT_SIZES "64,128,256,512,1024,2048,4096,8192"
+#define MAX_SIZES 20
+
+/* The functions that are timed.  Copy is the memcpy() of the background and of the ramp, the others are the
+ * kernels with the same names. */
+typedef enum {
+  BenchAddConstant,
+  BenchAddConstantRGB1,
+  BenchAddArray,
+  BenchAddScaledArray,
+  BenchAddPeakRow,
+  BenchAddPeakRowRGB1,
+  BenchAddSineRow,
+  BenchAddSineRowRGB1,
+  BenchFillUniform,
+  BenchAddGaussian,
+  BenchAddPoisson,
+  BenchAddBinnedRow,
+  BenchAccumulateUInt32,
+  BenchAccumulateUInt64,
+  BenchCopy,
+  BenchNumFunctions
+} benchFunction_t;
+
+/* The name of each function, the number of image elements read and written for each element, and the number of
+ * bytes of the sum read and written for each element */
+static const struct {
+  const char *name;
+  int accesses;
+  int sumBytes;
+} benchFunctions[BenchNumFunctions] = {
+  {"addConstant",      2, 0},
+  {"addConstantRGB1",  2, 0},
+  {"addArray",         3, 0},
+  {"addScaledArray",   3, 0},
+  {"addPeakRow",       3, 0},
+  {"addPeakRowRGB1",   2, 0},
+  {"addSineRow",       2, 0},
+  {"addSineRowRGB1",   2, 0},
+  {"fillUniform",      1, 0},
+  {"addGaussian",      2, 0},
+  {"addPoisson",       2, 0},
+  {"addBinnedRow",     2, 0},
+  {"accumulateUInt32", 1, 8},
+  {"accumulateUInt64", 1, 16},
+  {"copy",             2, 0}
+};
+
+/* The value of the image elements before each pass.  It is a valid mean for addPoisson for every data type. */
+#define BENCH_INITIAL_VALUE 50
+#define BENCH_SEED 1
+#define BENCH_BIN_X 2
+
+/** The number of image elements that one pass of a function computes for one row of size elements.
+  * The RGB1 kernels compute whole pixels, and addBinnedRow reads BENCH_BIN_X elements for each one it writes. */
+static size_t rowElements(int function, size_t size)
+{
+  switch (function) {
+    case BenchAddConstantRGB1:
+    case BenchAddPeakRowRGB1:
+    case BenchAddSineRowRGB1:
+      return size / 3 * 3;
+    case BenchAddBinnedRow:
+      return size / BENCH_BIN_X * BENCH_BIN_X;
+    default:
+      return size;
+  }
+}
+
+/** Template function to compute one size x size image with one function, one row at a time. */
+template <typename epicsType> static void runPass(int function, const simKernels<epicsType> *pKernels,
+                                                  epicsType *pData, const epicsType *pIn, epicsUInt64 *pSum,
+                                                  const double *pX, const double *pY, size_t size)
+{
+  const epicsType valueRGB[3] = {1, 2, 3};
+  const double yRGB[3] = {0., 1., 2.};
+  const double gainRGB[3] = {1., 2., 1.5};
+  epicsType *pRow;
+  const epicsType *pInRow;
+  size_t row;
+
+  for (row=0; row<size; row++) {
+    pRow = pData + row * size;
+    pInRow = pIn + row * size;
+    switch (function) {
+      case BenchAddConstant:
+        pKernels->addConstant(pRow, size, (epicsType)3);
+        break;
+      case BenchAddConstantRGB1:
+        pKernels->addConstantRGB1(pRow, size / 3, valueRGB);
+        break;
+      case BenchAddArray:
+        pKernels->addArray(pRow, pInRow, size);
+        break;
+      case BenchAddScaledArray:
+        pKernels->addScaledArray(pRow, pInRow, 0.9, size);
+        break;
+      case BenchAddPeakRow:
+        pKernels->addPeakRow(pRow, pInRow, 0.9, size);
+        break;
+      case BenchAddPeakRowRGB1:
+        pKernels->addPeakRowRGB1(pRow, pInRow, gainRGB, size / 3);
+        break;
+      case BenchAddSineRow:
+        pKernels->addSineRow(pRow, pX, pY[row], 2., size);
+        break;
+      case BenchAddSineRowRGB1:
+        pKernels->addSineRowRGB1(pRow, pX, yRGB, gainRGB, size / 3);
+        break;
+      case BenchFillUniform:
+        pKernels->fillUniform(pRow, size, BENCH_SEED, row * size, 10., 5.);
+        break;
+      case BenchAddGaussian:
+        pKernels->addGaussian(pRow, size, BENCH_SEED, 2 * row * size, 3.);
+        break;
+      case BenchAddPoisson:
+        pKernels->addPoisson(pRow, size, BENCH_SEED, 2 * row * size, 3.);
+        break;
+      case BenchAddBinnedRow:
+        pKernels->addBinnedRow(pRow, 1, pInRow, 1, size / BENCH_BIN_X, BENCH_BIN_X);
+        break;
+      case BenchAccumulateUInt32:
+        pKernels->accumulateUInt32((epicsUInt32 *)pSum + row * size, pInRow, size);
+        break;
+      case BenchAccumulateUInt64:
+        pKernels->accumulateUInt64(pSum + row * size, pInRow, size);
+        break;
+      case BenchCopy:
+        memcpy(pRow, pInRow, size * sizeof(epicsType));
+        break;
+    }
+  }
+}
+
+/** Template function to time all of the functions for one data type and image size, with each instruction set
+  * that the CPU supports, and write a line to the CSV file for each. */
+template <typename epicsType> static void benchType(FILE *fp, const char *typeName, size_t size, double duration,
+                                                    double cyclesPerNs)
+{
+  std::vector<epicsType> data(size * size), in(size * size, (epicsType)1);
+  std::vector<epicsUInt64> sum(size * size);
+  std::vector<double> x(size), y(size), passTimes;
+  SimKernel_t kernel, fastest = simKernelsDetect();
+  const simKernels<epicsType> *pKernels;
+  epicsUInt64 start, end, elapsed;
+  double elements, nsMin, nsMedian, bytes;
+  size_t i;
+  int function;
+
+  for (i=0; i<size; i++) {
+    x[i] = 10. * sin(0.01 * i);
+    y[i] = 5. * cos(0.02 * i);
+  }
+  for (kernel=SimKernelScalar; kernel<=fastest; kernel=(SimKernel_t)(kernel+1)) {
+    pKernels = simGetKernels<epicsType>(kernel);
+    for (function=0; function<BenchNumFunctions; function++) {
+      // Each pass starts from the same image, so the values and the time of addPoisson do not drift
+      passTimes.clear();
+      elapsed = 0;
+      do {
+        std::fill(data.begin(), data.end(), (epicsType)BENCH_INITIAL_VALUE);
+        start = epicsMonotonicGet();
+        runPass<epicsType>(function, pKernels, &data[0], &in[0], &sum[0], &x[0], &y[0], size);
+        end = epicsMonotonicGet();
+        passTimes.push_back((double)(end - start));
+        elapsed += end - start;
+      } while (elapsed < duration * 1.e9);
+      std::sort(passTimes.begin(), passTimes.end());
+      elements = (double)rowElements(function, size) * size;
+      nsMin = passTimes[0] / elements;
+      nsMedian = passTimes[passTimes.size() / 2] / elements;
+      bytes = (double)benchFunctions[function].accesses * sizeof(epicsType) + benchFunctions[function].sumBytes;
+      fprintf(fp, "%s,%s,%s,%d,%d,%.4f,%.4f,%.2f,", simKernelsName(kernel), benchFunctions[function].name,
+              typeName, (int)size, (int)passTimes.size(), nsMin, nsMedian, bytes / nsMin);
+      if (cyclesPerNs > 0.) {
+        fprintf(fp, "%.3f\n", bytes / (nsMin * cyclesPerNs));
+      } else {
+        fprintf(fp, "\n");
+      }
+      fflush(fp);
+    }
+  }
+}
+
+/** Returns the frequency of the time stamp counter in cycles per ns, or 0 if it cannot be read. */
+static double measureCyclesPerNs()
+{
+#ifdef BENCH_HAS_TSC
+  epicsUInt64 start, end, startCycles, endCycles;
+
+  start = epicsMonotonicGet();
+  startCycles = __rdtsc();
+  epicsThreadSleep(0.2);
+  end = epicsMonotonicGet();
+  endCycles = __rdtsc();
+  return (double)(endCycles - startCycles) / (double)(end - start);
+#else
+  return 0.;
+#endif
+}
+
+static void usage()
+{
+  fprintf(stderr, "Usage: simDetectorKernelBench [-d seconds] [-s size[,size...]] [-f GHz] [-o file.csv]\n"
+                  "  -d  Minimum time for each function (default %g s)\n"
+                  "  -s  Image sizes, each one is size x size elements (default %s)\n"
+                  "  -f  CPU clock frequency for bytes_per_cycle (default the time stamp counter frequency)\n"
+                  "  -o  CSV output file (default stdout)\n",
+          DEFAULT_DURATION, DEFAULT_SIZES);
+}
+
+int main(int argc, char **argv)
+{
+  double duration = DEFAULT_DURATION;
+  const char *sizeList = DEFAULT_SIZES;
+  const char *fileName = NULL;
+  double cyclesPerNs = 0.;
+  int sizes[MAX_SIZES];
+  int numSizes = 0;
+  char *sizeString, *token;
+  FILE *fp = stdout;
+  int opt, s;
+
+  while ((opt = getopt(argc, argv, "d:s:f:o:h")) != -1) {
+    switch (opt) {
+      case 'd': duration = atof(optarg); break;
+      case 's': sizeList = optarg; break;
+      case 'f': cyclesPerNs = atof(optarg); break;
+      case 'o': fileName = optarg; break;
+      default:  usage(); return 1;
+    }
+  }
+  sizeString = epicsStrDup(sizeList);
+  for (token = strtok(sizeString, ","); token && (numSizes < MAX_SIZES); token = strtok(NULL, ",")) {
+    sizes[numSizes] = atoi(token);
+    if (sizes[numSizes] > 0) numSizes++;
+  }
+  free(sizeString);
+  if ((numSizes == 0) || (duration <= 0.) || (cyclesPerNs < 0.)) {
+    usage();
+    return 1;
+  }
+  if (cyclesPerNs == 0.) cyclesPerNs = measureCyclesPerNs();
+  if (fileName) {
+    fp = fopen(fileName, "w");
+    if (!fp) {
+      perror(fileName);
+      return 1;
+    }
+  }
+
+  fprintf(fp, "kernel,function,data_type,size,passes,ns_per_element_min,ns_per_element_median,"
+              "GB_per_s,bytes_per_cycle\n");
+  for (s=0; s<numSizes; s++) {
+    benchType<epicsInt8>   (fp, "Int8",    sizes[s], duration, cyclesPerNs);
+    benchType<epicsUInt8>  (fp, "UInt8",   sizes[s], duration, cyclesPerNs);
+    benchType<epicsInt16>  (fp, "Int16",   sizes[s], duration, cyclesPerNs);
+    benchType<epicsUInt16> (fp, "UInt16",  sizes[s], duration, cyclesPerNs);
+    benchType<epicsInt32>  (fp, "Int32",   sizes[s], duration, cyclesPerNs);
+    benchType<epicsUInt32> (fp, "UInt32",  sizes[s], duration, cyclesPerNs);
+    benchType<epicsInt64>  (fp, "Int64",   sizes[s], duration, cyclesPerNs);
+    benchType<epicsUInt64> (fp, "UInt64",  sizes[s], duration, cyclesPerNs);
+    benchType<epicsFloat32>(fp, "Float32", sizes[s], duration, cyclesPerNs);
+    benchType<epicsFloat64>(fp, "Float64", sizes[s], duration, cyclesPerNs);
+  }
+  if (fp != stdout) fclose(fp);
+  return 0;
+}
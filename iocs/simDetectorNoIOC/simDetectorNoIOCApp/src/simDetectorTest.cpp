@@ -0,0 +1,160 @@
+/* simDetectorTest.cpp
+ *
+ * Unit tests of the simDetector, run outside an IOC by "make runtests".
+ *
+ * They acquire a few small images and check how parameter changes affect the images kept for replay: a change to
+ * a parameter of the image must discard them, and a change that only affects how the images are computed must
+ * keep them.
+ *
+ */
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+#include <epicsThread.h>
+#include <epicsMutex.h>
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <asynPortClient.h>
+#include <simDetector.h>
+
+#define TEST_SIZE 64
+#define TEST_REPLAY_FRAMES 2
+#define TEST_TIMEOUT 10.0
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+static asynPortClient *pSimClient;
+static epicsMutex hashLock;
+static std::vector<epicsUInt64> hashes;  /* The hashes of the images received since acquire() was called */
+
+/** Records the 64-bit FNV-1a hash of the data of each image */
+static void NDArrayCallbackC(void *drvPvt, asynUser *pasynUser, void *pData)
+{
+  NDArray *pArray = (NDArray *)pData;
+  const unsigned char *pBytes = (const unsigned char *)pArray->pData;
+  NDArrayInfo_t arrayInfo;
+  epicsUInt64 hash = FNV_OFFSET_BASIS;
+  size_t i;
+
+  pArray->getInfo(&arrayInfo);
+  for (i=0; i<arrayInfo.totalBytes; i++) {
+    hash ^= pBytes[i];
+    hash *= FNV_PRIME;
+  }
+  hashLock.lock();
+  hashes.push_back(hash);
+  hashLock.unlock();
+}
+
+/** Acquires numImages images and waits until the driver has stopped.
+  * \return The hashes of the images, which are fewer than numImages on a timeout. */
+static std::vector<epicsUInt64> acquire(int numImages)
+{
+  std::vector<epicsUInt64> received;
+  double waited;
+  int acquiring = 1;
+
+  hashLock.lock();
+  hashes.clear();
+  hashLock.unlock();
+  pSimClient->write(ADImageModeString, ADImageMultiple);
+  pSimClient->write(ADNumImagesString, numImages);
+  pSimClient->write(ADAcquireString, 1);
+  for (waited=0.; waited<TEST_TIMEOUT; waited+=0.001) {
+    hashLock.lock();
+    received = hashes;
+    hashLock.unlock();
+    pSimClient->read(ADAcquireString, &acquiring);
+    if (!acquiring && ((int)received.size() >= numImages)) break;
+    epicsThreadSleep(0.001);
+  }
+  if (acquiring) pSimClient->write(ADAcquireString, 0);
+  return received;
+}
+
+static bool contains(const std::vector<epicsUInt64> &values, epicsUInt64 value)
+{
+  return std::find(values.begin(), values.end(), value) != values.end();
+}
+
+static int replayNumFrames()
+{
+  int numFrames;
+
+  pSimClient->read(SimReplayNumFramesString, &numFrames);
+  return numFrames;
+}
+
+/** Acquires enough images to fill the replay ring and returns the hashes of the images in it */
+static std::vector<epicsUInt64> fillReplay()
+{
+  std::vector<epicsUInt64> images = acquire(2 * TEST_REPLAY_FRAMES);
+
+  testOk((images.size() == 2 * TEST_REPLAY_FRAMES) && (replayNumFrames() == TEST_REPLAY_FRAMES),
+         "%d images kept for replay", TEST_REPLAY_FRAMES);
+  testOk((images.size() == 2 * TEST_REPLAY_FRAMES) &&
+         std::equal(images.begin(), images.begin() + TEST_REPLAY_FRAMES, images.begin() + TEST_REPLAY_FRAMES),
+         "The kept images are published again");
+  images.resize(TEST_REPLAY_FRAMES);
+  return images;
+}
+
+/** Checks that writing an integer parameter of the image discards the images kept for replay */
+static void testImageParam(const char *paramName, int value)
+{
+  std::vector<epicsUInt64> kept = fillReplay();
+  std::vector<epicsUInt64> images;
+
+  pSimClient->write(paramName, value);
+  images = acquire(1);
+  testOk((images.size() == 1) && !contains(kept, images[0]), "%s changes the next image", paramName);
+  testOk(replayNumFrames() == 1, "%s discards the images kept for replay", paramName);
+}
+
+/** Checks that writing a parameter that does not change the images does not discard the images kept for replay */
+static void testTimingParam(const char *paramName, int value)
+{
+  std::vector<epicsUInt64> kept = fillReplay();
+  std::vector<epicsUInt64> images;
+
+  pSimClient->write(paramName, value);
+  images = acquire(TEST_REPLAY_FRAMES);
+  testOk((images.size() == TEST_REPLAY_FRAMES) && contains(kept, images[0]) && contains(kept, images[1]),
+         "%s does not discard the images kept for replay", paramName);
+}
+
+MAIN(simDetectorTest)
+{
+  asynGenericPointerClient *pNDArray;
+
+  testPlan(11);
+  new simDetector("SIMTEST", TEST_SIZE, TEST_SIZE, NDFloat64, 0, 0, 0, 0);
+  pSimClient = new asynPortClient("SIMTEST");
+  pSimClient->write(NDArrayCallbacksString, 1);
+  pSimClient->write(ADAcquireTimeString, 0.0);
+  pSimClient->write(ADAcquirePeriodString, 0.0);
+  pSimClient->write(SimModeString, SimModeSine);
+  pSimClient->write(ADGainString, 1.0);
+  pSimClient->write(SimGainXString, 1.0);
+  pSimClient->write(SimGainYString, 1.0);
+  pSimClient->write(SimXSine1AmplitudeString, 100.0);
+  pSimClient->write(SimXSine1FrequencyString, 5.0);
+  pSimClient->write(SimXSine2AmplitudeString, 50.0);
+  pSimClient->write(SimXSine2FrequencyString, 2.0);
+  pSimClient->write(SimYSine1AmplitudeString, 100.0);
+  pSimClient->write(SimYSine1FrequencyString, 3.0);
+  pSimClient->write(SimYSine2AmplitudeString, 20.0);
+  pSimClient->write(SimYSine2FrequencyString, 7.0);
+  pSimClient->write(SimReplayFramesString, TEST_REPLAY_FRAMES);
+  pNDArray = (asynGenericPointerClient *)pSimClient->getParamClient(NDArrayDataString);
+  pNDArray->registerInterruptUser(NDArrayCallbackC, NULL);
+
+  testImageParam(SimXSineOperationString, SimSineOperationMultiply);
+  testImageParam(SimYSineOperationString, SimSineOperationMultiply);
+  testTimingParam(SimNumThreadsString, 2);
+
+  return testDone();
+}
@@ -16,10 +16,12 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <algorithm>
 
 #include <epicsTime.h>
 #include <epicsThread.h>
 #include <epicsEvent.h>
+#include <epicsMessageQueue.h>
 #include <epicsMutex.h>
 #include <epicsString.h>
 #include <epicsStdio.h>
@@ -33,63 +35,168 @@
 
 static const char *driverName = "simDetector";
 
-#define MIN_DELAY 1e-5
 #define MAX_PEAK_SIGMA 4
 
+/* The number of elements of a sine wave that are computed from each call to sin() */
+#define SIM_SINE_ANCHOR 64
+
+/* The minimum time between updates of the stage time statistics in ns */
+#define SIM_STAGE_UPDATE_PERIOD 200000000
+
+/* The default time before each deadline that simTask() spins rather than sleeps, in seconds */
+#define SIM_DEFAULT_SPIN_TIME 0.001
+
+/* The time between updates of SimFrameRate, SimDataRate and SimSubFrameRate in ns, and the weight
+ * of each new rate in their exponential moving averages */
+#define SIM_RATE_UPDATE_PERIOD 500000000
+#define SIM_RATE_SMOOTHING 0.5
+
 /* Some systems don't define M_PI in math.h */
 #ifndef M_PI
   #define M_PI 3.14159265358979323846
 #endif
 
-/** Template function to compute the simulated detector data for any data type */
+/** Reads the parameters used to compute an image into params_.
+  * This is done once per image, so the worker threads never access the parameter library. */
+void simDetector::getFrameParams()
+{
+    int itemp;
+    simFrameParams_t *p = &params_;
+
+    getIntegerParam(NDDataType,             &itemp); p->dataType = (NDDataType_t)itemp;
+    getIntegerParam(NDColorMode,            &p->colorMode);
+    getIntegerParam(SimMode,                &p->simMode);
+    getIntegerParam(SimNumThreads,          &p->numThreads);
+    getIntegerParam(SimSIMDKernel,          &itemp); p->kernel = (SimKernel_t)itemp;
+    getDoubleParam (ADGain,                 &p->gain);
+    getDoubleParam (SimGainX,               &p->gainX);
+    getDoubleParam (SimGainY,               &p->gainY);
+    getDoubleParam (SimGainRed,             &p->gainRed);
+    getDoubleParam (SimGainGreen,           &p->gainGreen);
+    getDoubleParam (SimGainBlue,            &p->gainBlue);
+    getDoubleParam (SimOffset,              &p->offset);
+    getDoubleParam (SimNoise,               &p->noise);
+    getIntegerParam(SimNoiseType,           &p->noiseType);
+    getIntegerParam(SimNoiseSeed,           &p->noiseSeed);
+    getIntegerParam(SimPeakStartX,          &p->peakStartX);
+    getIntegerParam(SimPeakStartY,          &p->peakStartY);
+    getIntegerParam(SimPeakWidthX,          &p->peakWidthX);
+    getIntegerParam(SimPeakWidthY,          &p->peakWidthY);
+    getIntegerParam(SimPeakNumX,            &p->peakNumX);
+    getIntegerParam(SimPeakNumY,            &p->peakNumY);
+    getIntegerParam(SimPeakStepX,           &p->peakStepX);
+    getIntegerParam(SimPeakStepY,           &p->peakStepY);
+    getDoubleParam (SimPeakHeightVariation, &p->peakVariation);
+    getIntegerParam(SimXSineOperation,      &p->xSineOperation);
+    getDoubleParam (SimXSine1Amplitude,     &p->xSine1Amplitude);
+    getDoubleParam (SimXSine1Frequency,     &p->xSine1Frequency);
+    getDoubleParam (SimXSine1Phase,         &p->xSine1Phase);
+    getDoubleParam (SimXSine2Amplitude,     &p->xSine2Amplitude);
+    getDoubleParam (SimXSine2Frequency,     &p->xSine2Frequency);
+    getDoubleParam (SimXSine2Phase,         &p->xSine2Phase);
+    getIntegerParam(SimYSineOperation,      &p->ySineOperation);
+    getDoubleParam (SimYSine1Amplitude,     &p->ySine1Amplitude);
+    getDoubleParam (SimYSine1Frequency,     &p->ySine1Frequency);
+    getDoubleParam (SimYSine1Phase,         &p->ySine1Phase);
+    getDoubleParam (SimYSine2Amplitude,     &p->ySine2Amplitude);
+    getDoubleParam (SimYSine2Frequency,     &p->ySine2Frequency);
+    getDoubleParam (SimYSine2Phase,         &p->ySine2Phase);
+}
+
+/** Returns the SimDirty_t flags of the state that must be recomputed when a parameter changes.
+  * writeInt32() and writeFloat64() handle the parameters of this class and the base class parameters with flags
+  * here, and pass the other base class parameters to ADDriver.
+  * \param[in] function The parameter that has changed. */
+int simDetector::paramDirtyFlags(int function)
+{
+    if ((function == NDDataType) || (function == NDColorMode)) {
+        return SIM_DIRTY_ALL;
+    } else if (function == SimMode) {
+        return SimDirtyRamp | SimDirtyPeaks | SimDirtySine | SimDirtyImage;
+    } else if ((function == SimOffset) || (function == SimNoise) ||
+               (function == SimNoiseSeed) || (function == SimNoiseType)) {
+        return SimDirtyBackground | SimDirtyImage;
+    } else if (function == ADGain) {
+        return SimDirtyRamp | SimDirtyPeaks | SimDirtyImage;
+    } else if ((function == SimGainX) || (function == SimGainY) ||
+               (function == SimGainRed) || (function == SimGainGreen) || (function == SimGainBlue)) {
+        return SimDirtyRamp | SimDirtyImage;
+    } else if ((function == SimPeakWidthX) || (function == SimPeakWidthY)) {
+        return SimDirtyPeaks | SimDirtyImage;
+    } else if (function < FIRST_SIM_DETECTOR_PARAM) {
+        /* The region of interest, binning and reversal are compared with the replay images by computeImage() */
+        return 0;
+    } else if ((function == SimResetImage) || (function == SimNumThreads) || (function == SimSIMDKernel) ||
+               (function == SimQueueSize) || (function == SimReplayFrames) || (function == SimReplayMaxMemory) ||
+               (function == SimSpinTime) || (function == SimStatusRate) || (function == SimBatchSize) ||
+               (function == SimReadoutTime) || (function == SimDeadTime) || (function == SimReadoutOverlap) ||
+               (function == SimSubFrames) || (function == SimSumDataType)) {
+        /* These only change when and how the images are computed and published, not the images.
+         * SimResetImage is read by computeImage(). */
+        return 0;
+    }
+    /* The peak positions, peak height variation and sine waves are computed for each image from the parameters */
+    return SimDirtyImage;
+}
+
+/** Template function to compute the simulated detector data for any data type.
+  * The work that must be done serially (peak profile, sine tables) is done here,
+  * then the background and the rows of the output image are computed by computeBands().
+  * Only the pixels in the window set by computeImage() are computed. In linear ramp mode each image is computed
+  * from the previous one, so the ramp is also updated for the rows outside the window. */
 template <typename epicsType> int simDetector::computeArray(int sizeX, int sizeY)
 {
-    int simMode;
     int status = asynSuccess;
-    int resetImage;
     epicsType offset;
-    double dOffset;
-    double noise;
-    int i;
-    epicsType* pRawData = (epicsType*)pRaw_->pData;
-    epicsType* pBackgroundData = (epicsType*)pBackground_->pData;
-
-    getIntegerParam(SimMode, &simMode);
-    getIntegerParam(SimResetImage, &resetImage);
-    getDoubleParam(SimOffset, &dOffset);
-    getDoubleParam(SimNoise, &noise);
-
-    offset = (epicsType)dOffset;
-    if (resetImage) {
-        useBackground_ = false;
-        if ((noise != 0.) || (offset != 0)) {
-            useBackground_ = true;
-            if (noise == 0) {
-                for (i=0; i<arrayInfo_.nElements; i++) {
-                    pBackgroundData[i] = offset;
-                }
-            } else {
-                for (i=0; i<arrayInfo_.nElements; i++) {
-                    pBackgroundData[i] = (epicsType)((noise * (rand() / (double)RAND_MAX)) + offset);
-                }
-            }
-        }
+    double noise = params_.noise;
+    size_t scratchSize;
+
+    sizeX_ = sizeX;
+    sizeY_ = sizeY;
+    offset = (epicsType)params_.offset;
+    if (params_.dirty & SimDirtyBuffers) {
+        computeRows_ = getComputeRows<epicsType>(params_.colorMode);
+    }
+    if (params_.dirty & SimDirtyBackground) {
+        bool hadBackground = useBackground_;
+        /* The random numbers start again from the beginning of their sequences for SimNoiseSeed */
+        randomFrame_ = 0;
+        useBackground_ = ((noise != 0.) && (params_.noiseType == SimNoiseFixed)) || (offset != 0);
+        frameNoise_ = (params_.noiseType == SimNoisePoisson) ||
+                      ((params_.noiseType == SimNoiseGaussian) && (noise != 0.));
+        /* The ramp is kept in a different buffer with a background, so it starts again if that changes */
+        if (useBackground_ != hadBackground) params_.dirty |= SimDirtyRamp;
+    }
+
+    /* If there is binning or reversal in X each band needs room for the binY image rows of one output row */
+    scratchSize_ = 0;
+    if ((params_.binX != 1) || (params_.binY != 1) || params_.reverseX) {
+        scratchSize = params_.binY * 3 * (windowMaxX_ - windowMinX_) * sizeof(epicsType);
+        /* Round up to a cache line so the bands do not share one */
+        scratchSize_ = (scratchSize + 63) & ~(size_t)63;
+    }
+
+    /* In linear ramp mode with no background, noise for each image, region of interest, binning or reversal the
+     * output image has the same layout as the full image, so each image is computed from the previous one and pRaw_
+     * is not used.  Otherwise the ramp is kept in pRaw_, so copy it there if the previous image was computed this
+     * way. */
+    rampInImage_ = (params_.simMode == SimModeLinearRamp) &&
+                   !useBackground_ && !frameNoise_ && (scratchSize_ == 0) && !params_.reverseY &&
+                   (windowMinX_ == 0) && (windowMaxX_ == sizeX) && (windowMinY_ == 0) && (windowMaxY_ == sizeY);
+
+    status = updateWorkBuffers();
+    if (status) return status;
+    if ((params_.dirty & SimDirtyBackground) && useBackground_) {
+        computeBands(SimBandBackgroundRows);
     }
 
     if (useBackground_) {
-        // Copy the pre-computed random noise array starting at a random location
-        int backgroundStart = (int)((arrayInfo_.nElements) * (rand() / (double)RAND_MAX));
-        int numCopy1 = (arrayInfo_.nElements - backgroundStart) * arrayInfo_.bytesPerElement;
-        int numCopy2 = backgroundStart * arrayInfo_.bytesPerElement;
-        memcpy(pRawData, pBackgroundData + backgroundStart, numCopy1);
-        memcpy(pRawData + arrayInfo_.nElements - backgroundStart, pBackgroundData, numCopy2);
-    } else {
-        if (simMode != SimModeLinearRamp) {
-            memset(pRawData, 0, arrayInfo_.totalBytes);
-        }
+        // The pre-computed random noise array is copied starting at a random location
+        backgroundStart_ = (int)((bufferElements_) *
+            simRandomUniform(params_.noiseSeed, SIM_RANDOM_COUNTER(SimRandomBackgroundStart, randomFrame_)));
     }
 
-    switch(simMode) {
+    switch(params_.simMode) {
         case SimModeLinearRamp:
             status = computeLinearRampArray<epicsType>(sizeX, sizeY);
             break;
@@ -103,75 +210,469 @@ template <typename epicsType> int simDetector::computeArray(int sizeX, int sizeY
             break;
     }
 
+    if (rampInImage_) {
+        pRampPrevious_ = pRampImage_ ? pRampImage_->pData : pRaw_->pData;
+    } else if ((params_.simMode == SimModeLinearRamp) && pRampImage_ && !(params_.dirty & SimDirtyRamp) &&
+               !useBackground_) {
+        memcpy(pRaw_->pData, pRampImage_->pData, bufferElements_ * sizeof(epicsType));
+    }
+    if (!rampInImage_ && pRampImage_) {
+        pRampImage_->release();
+        pRampImage_ = NULL;
+    }
+
+    if ((params_.simMode == SimModeLinearRamp) && (windowMaxY_ - windowMinY_ < sizeY)) {
+        computeBands(SimBandRampRows);
+    }
+    computeBands(SimBandImageRows);
+
+    /* Keep this image, because the next one is computed from it */
+    if (rampInImage_) {
+        if (pRampImage_) pRampImage_->release();
+        pRampImage_ = pImage_;
+        pRampImage_->reserve();
+    }
+
+    randomFrame_++;
     return status;
 }
 
-/** Template function to compute the simulated detector data for any data type */
+/** Template function to compute rows [firstRow, lastRow) of the background, which is offset plus uniform random
+  * noise if SimNoiseType is SimNoiseFixed.  A row is nElements/sizeY consecutive elements whatever the color mode.
+  * The random number for each element only depends on SimNoiseSeed and the element index, so the background does
+  * not depend on how the rows are split between threads. */
+template <typename epicsType> void simDetector::computeBackgroundRows(int firstRow, int lastRow)
+{
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+    size_t rowElements = bufferElements_ / sizeY_;
+    size_t first = firstRow * rowElements;
+    size_t count = (lastRow - firstRow) * rowElements;
+    epicsType *pBackgroundData = (epicsType *)pBackground_->pData + first;
+    epicsType offset = (epicsType)params_.offset;
+    size_t i;
+
+    if ((params_.noise == 0) || (params_.noiseType != SimNoiseFixed)) {
+        for (i=0; i<count; i++) {
+            pBackgroundData[i] = offset;
+        }
+    } else {
+        pKernels->fillUniform(pBackgroundData, count, params_.noiseSeed,
+                              SIM_RANDOM_COUNTER(SimRandomBackground, first), params_.noise, offset);
+    }
+}
+
+/** Returns the ranges of elements of the full image that hold the window columns of one image row
+  * in the current color mode.
+  * \param[in] row The image row.
+  * \param[in] colorStride The distance between the colors of a pixel in the row being computed.
+  * \param[out] start Array of 3 values; the first element of each range in the full image.
+  * \param[out] count Array of 3 values; the number of elements in each range.
+  * \param[out] outOffset Array of 3 values; the offset of each range in the row being computed.
+  * \return The number of ranges, which is 3 for RGB2 and RGB3 (one per color) and 1 for the other color modes. */
+template <int colorMode> int simDetector::getRowRanges(int row, size_t colorStride, size_t *start, size_t *count,
+                                                       size_t *outOffset)
+{
+    size_t rowSize = sizeX_;
+    size_t planeSize = rowSize * sizeY_;
+    size_t minX = windowMinX_;
+    size_t width = windowMaxX_ - windowMinX_;
+    int i;
+
+    switch (colorMode) {
+        case NDColorModeRGB1:
+            start[0] = 3 * (row * rowSize + minX);
+            count[0] = 3 * width;
+            outOffset[0] = 0;
+            return 1;
+        case NDColorModeRGB2:
+            for (i=0; i<3; i++) {
+                start[i] = (3 * row + i) * rowSize + minX;
+                count[i] = width;
+                outOffset[i] = i * colorStride;
+            }
+            return 3;
+        case NDColorModeRGB3:
+            for (i=0; i<3; i++) {
+                start[i] = i * planeSize + row * rowSize + minX;
+                count[i] = width;
+                outOffset[i] = i * colorStride;
+            }
+            return 3;
+        default:
+            start[0] = row * rowSize + minX;
+            count[0] = width;
+            outOffset[0] = 0;
+            return 1;
+    }
+}
+
+/** Copies count elements of the pre-computed background into pOut, for the image elements starting at start.
+  * The background is shifted by backgroundStart_ elements and wraps around at the end of the array. */
+template <typename epicsType> void simDetector::copyBackground(epicsType *pOut, size_t start, size_t count)
+{
+    epicsType *pBackgroundData = (epicsType*)pBackground_->pData;
+    size_t nElements = bufferElements_;
+    size_t in = start + backgroundStart_;
+    size_t numCopy;
+
+    if (in >= nElements) in -= nElements;
+    while (count > 0) {
+        numCopy = nElements - in;
+        if (numCopy > count) numCopy = count;
+        memcpy(pOut, pBackgroundData + in, numCopy * sizeof(epicsType));
+        pOut  += numCopy;
+        count -= numCopy;
+        in = 0;
+    }
+}
+
+/** Template function to compute the window columns of one image row, for one data type and color mode.
+  * \param[in] row The image row.
+  * \param[out] pOut Where to write the first pixel of the row.
+  *   The pixels are 3 elements apart in RGB1 and adjacent in the other color modes.
+  * \param[in] colorStride The distance between the colors of a pixel; 1 for RGB1. */
+template <typename epicsType, int colorMode> void simDetector::computeRow(int row, epicsType *pOut,
+                                                                          size_t colorStride)
+{
+    epicsType *pRawData = pRaw_ ? (epicsType*)pRaw_->pData : NULL;
+    epicsType *pRampData = pRamp_ ? (epicsType*)pRamp_->pData : NULL;
+    epicsType *pImageData = (epicsType*)pImage_->pData;
+    epicsType *pPrevious = (epicsType*)pRampPrevious_;
+    size_t start[3], count[3], outOffset[3];
+    int numRanges;
+    int i;
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+
+    numRanges = getRowRanges<colorMode>(row, colorStride, start, count, outOffset);
+    if (params_.simMode == SimModeLinearRamp) {
+        if (rampInImage_) {
+            /* The output image has the same layout as the full image.
+             * The ramp is computed in it by updating this row of the previous image. */
+            if (!(params_.dirty & SimDirtyRamp)) {
+                for (i=0; i<numRanges; i++) {
+                    memcpy(pImageData + start[i], pPrevious + start[i], count[i] * sizeof(epicsType));
+                }
+            }
+            computeLinearRampRows<epicsType, colorMode>(row, row+1, pImageData);
+            return;
+        }
+        /* The ramp is kept in pRamp_ if there is a background and in pRaw_ if not */
+        computeLinearRampRows<epicsType, colorMode>(row, row+1, useBackground_ ? pRampData : pRawData);
+    }
+
+    for (i=0; i<numRanges; i++) {
+        if (useBackground_) {
+            copyBackground<epicsType>(pOut + outOffset[i], start[i], count[i]);
+            if (params_.simMode == SimModeLinearRamp) {
+                pKernels->addArray(pOut + outOffset[i], pRampData + start[i], count[i]);
+            }
+        } else if (params_.simMode == SimModeLinearRamp) {
+            memcpy(pOut + outOffset[i], pRawData + start[i], count[i] * sizeof(epicsType));
+        } else {
+            memset(pOut + outOffset[i], 0, count[i] * sizeof(epicsType));
+        }
+    }
+
+    switch(params_.simMode) {
+        case SimModePeaks:
+            computePeaksRow<epicsType, colorMode>(row, pOut, colorStride);
+            break;
+        case SimModeSine:
+            computeSineRow<epicsType, colorMode>(row, pOut, colorStride);
+            break;
+        default:
+            break;
+    }
+
+    /* New noise for each element of each image.  The random numbers only depend on SimNoiseSeed, the image number
+     * since the reset and the element index, so they do not depend on how the rows are split between threads. */
+    if (frameNoise_) {
+        for (i=0; i<numRanges; i++) {
+            if (params_.noiseType == SimNoisePoisson) {
+                pKernels->addPoisson(pOut + outOffset[i], count[i], SIM_RANDOM_FRAME_KEY(params_.noiseSeed),
+                                     SIM_RANDOM_FRAME_COUNTER(randomFrame_, start[i]), params_.noise);
+            } else {
+                pKernels->addGaussian(pOut + outOffset[i], count[i], SIM_RANDOM_FRAME_KEY(params_.noiseSeed),
+                                      SIM_RANDOM_FRAME_COUNTER(randomFrame_, start[i]), params_.noise);
+            }
+        }
+    }
+}
+
+/** Template function to compute rows [firstRow, lastRow) of the output image in pImage_.
+  * If there is no binning and no reversal in X, each image row is computed directly into the output image.
+  * Otherwise the image rows for an output row are computed into the scratch buffer of this band and then binned
+  * into the output row, adding the pixels in the same order as NDArrayPool::convert().
+  * For SimBandRampRows this instead updates the linear ramp for rows [firstRow, lastRow) of those outside the window.
+  * This is called by computeBands() from the simTask thread and from the worker threads.
+  * The color mode is a template parameter, so the layout of the pixels is known when each loop is compiled.
+  * \param[in] band The band number, which selects the scratch buffer.
+  * \param[in] firstRow First row of the band.
+  * \param[in] lastRow One past the last row of the band. */
+template <typename epicsType, int colorMode> void simDetector::computeRows(int band, int firstRow, int lastRow)
+{
+    epicsType *pImageData = (epicsType *)pImage_->pData;
+    epicsType *pScratch, *pOutRow, *pIn, *pOut, *pRamp;
+    int numColors = (colorMode == NDColorModeMono) ? 1 : 3;
+    int binX = params_.binX, binY = params_.binY;
+    int reverseX = params_.reverseX, reverseY = params_.reverseY;
+    size_t outSizeX = params_.outSizeX;
+    size_t width = windowMaxX_ - windowMinX_;
+    size_t xStride = 1, rowSize, outColorStride = 0, inColorStride = 0;
+    size_t ox;
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+    int row, outRow, windowRow;
+    int by, c;
+
+    if (bandTask_ == SimBandBackgroundRows) {
+        computeBackgroundRows<epicsType>(firstRow, lastRow);
+        return;
+    }
+    if (bandTask_ == SimBandRampRows) {
+        pRamp = (epicsType *)(useBackground_ ? pRamp_->pData : pRaw_->pData);
+        /* Rows [0, windowMinY_) are followed by rows [windowMaxY_, sizeY_) */
+        for (row=firstRow; row<lastRow; row++) {
+            windowRow = (row < windowMinY_) ? row : row + windowMaxY_ - windowMinY_;
+            computeLinearRampRows<epicsType, colorMode>(windowRow, windowRow+1, pRamp);
+        }
+        return;
+    }
+
+    /* The layout of an output row, and of an image row in the scratch buffer */
+    switch (colorMode) {
+        case NDColorModeRGB1:
+            xStride = 3;
+            rowSize = 3 * outSizeX;
+            outColorStride = 1;
+            inColorStride = 1;
+            break;
+        case NDColorModeRGB2:
+            rowSize = 3 * outSizeX;
+            outColorStride = outSizeX;
+            inColorStride = width;
+            break;
+        case NDColorModeRGB3:
+            rowSize = outSizeX;
+            outColorStride = outSizeX * params_.outSizeY;
+            inColorStride = width;
+            break;
+        default:
+            rowSize = outSizeX;
+            break;
+    }
+
+    for (outRow=firstRow; outRow<lastRow; outRow++) {
+        pOutRow = pImageData + outRow * rowSize;
+        /* The first image row that is binned into this output row */
+        if (reverseY) {
+            windowRow = windowMinY_ + (params_.outSizeY - 1 - outRow) * binY;
+        } else {
+            windowRow = windowMinY_ + outRow * binY;
+        }
+        if (scratchSize_ == 0) {
+            computeRow<epicsType, colorMode>(windowRow, pOutRow, outColorStride);
+            continue;
+        }
+
+        pScratch = (epicsType *)(&scratch_[0] + band * scratchSize_);
+        for (by=0; by<binY; by++) {
+            computeRow<epicsType, colorMode>(windowRow + by, pScratch + by * numColors * width, inColorStride);
+        }
+        for (c=0; c<numColors; c++) {
+            pOut = pOutRow + c * outColorStride;
+            for (ox=0; ox<outSizeX; ox++) {
+                pOut[ox * xStride] = 0;
+            }
+        }
+        for (by=0; by<binY; by++) {
+            pIn = pScratch + (reverseY ? binY - 1 - by : by) * numColors * width;
+            for (c=0; c<numColors; c++) {
+                if (reverseX) {
+                    pKernels->addBinnedRow(pOutRow + c * outColorStride, xStride,
+                                           pIn + (width - 1) * xStride + c * inColorStride, -(ptrdiff_t)xStride,
+                                           outSizeX, binX);
+                } else {
+                    pKernels->addBinnedRow(pOutRow + c * outColorStride, xStride,
+                                           pIn + c * inColorStride, xStride, outSizeX, binX);
+                }
+            }
+        }
+    }
+}
+
+/** Returns the computeRows() for a color mode and this data type.
+  * This is called when the image is reset, rather than testing the data type and color mode for each band. */
+template <typename epicsType> simDetector::computeRowsFunc_t simDetector::getComputeRows(int colorMode)
+{
+    switch (colorMode) {
+        case NDColorModeRGB1:
+            return &simDetector::computeRows<epicsType, NDColorModeRGB1>;
+        case NDColorModeRGB2:
+            return &simDetector::computeRows<epicsType, NDColorModeRGB2>;
+        case NDColorModeRGB3:
+            return &simDetector::computeRows<epicsType, NDColorModeRGB3>;
+        default:
+            return &simDetector::computeRows<epicsType, NDColorModeMono>;
+    }
+}
+
+/** Computes rows [firstRow, lastRow) of band for the current data type and color mode */
+void simDetector::computeRows(int band, int firstRow, int lastRow)
+{
+    (this->*computeRows_)(band, firstRow, lastRow);
+}
+
+static void simWorkerTaskC(void *drvPvt)
+{
+    simWorker_t *pWorker = (simWorker_t *)drvPvt;
+
+    pWorker->pSimDetector->workerTask(pWorker);
+}
+
+/** This thread waits for computeBands() to assign it a band of rows, computes them, and signals that it is done. */
+void simDetector::workerTask(simWorker_t *pWorker)
+{
+    while (1) {
+        epicsEventWait(pWorker->startEventId);
+        computeRows(pWorker->band, pWorker->firstRow, pWorker->lastRow);
+        epicsEventSignal(pWorker->doneEventId);
+    }
+}
+
+/** Computes all rows of the output image, or for SimBandRampRows updates the linear ramp for all rows outside
+  * the window.
+  * The rows are split into SimNumThreads bands of nearly equal size. The calling thread computes the first band
+  * and the worker threads compute the others. Each output element is computed by exactly the same operations
+  * as with a single thread, so the image does not depend on the number of threads. */
+void simDetector::computeBands(int task)
+{
+    int numThreads = params_.numThreads;
+    int numRows;
+    int rowsPerThread, extraRows;
+    int firstRow, lastRow;
+    int i;
+    char taskName[40];
+    const char *functionName = "computeBands";
+
+    if (task == SimBandRampRows) {
+        numRows = sizeY_ - (windowMaxY_ - windowMinY_);
+    } else if (task == SimBandBackgroundRows) {
+        numRows = sizeY_;
+    } else {
+        numRows = params_.outSizeY;
+    }
+    if (numRows <= 0) return;
+    if (numThreads > numRows) numThreads = numRows;
+    if (numThreads < 1) numThreads = 1;
+    bandTask_ = task;
+
+    /* Create any worker threads that we need but do not yet have */
+    while (numWorkers_ < numThreads-1) {
+        simWorker_t *pWorker = &workers_[numWorkers_];
+        pWorker->pSimDetector = this;
+        pWorker->band = numWorkers_ + 1;
+        pWorker->startEventId = epicsEventCreate(epicsEventEmpty);
+        pWorker->doneEventId = epicsEventCreate(epicsEventEmpty);
+        epicsSnprintf(taskName, sizeof(taskName), "SimDetWorker%d", numWorkers_+1);
+        if (!pWorker->startEventId || !pWorker->doneEventId ||
+            (epicsThreadCreate(taskName,
+                               epicsThreadPriorityMedium,
+                               epicsThreadGetStackSize(epicsThreadStackMedium),
+                               (EPICSTHREADFUNC)simWorkerTaskC,
+                               pWorker) == NULL)) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: error creating worker thread %d\n",
+                      driverName, functionName, numWorkers_+1);
+            numThreads = numWorkers_ + 1;
+            break;
+        }
+        /* The bands are computed without the lock, but report() reads numWorkers_ with it */
+        this->lock();
+        numWorkers_++;
+        this->unlock();
+    }
+
+    if (scratch_.size() < numThreads * scratchSize_) {
+        scratch_.resize(numThreads * scratchSize_);
+    }
+
+    rowsPerThread = numRows / numThreads;
+    extraRows = numRows % numThreads;
+    lastRow = rowsPerThread + ((extraRows > 0) ? 1 : 0);
+    for (i=1; i<numThreads; i++) {
+        firstRow = lastRow;
+        lastRow = firstRow + rowsPerThread + ((i < extraRows) ? 1 : 0);
+        workers_[i-1].firstRow = firstRow;
+        workers_[i-1].lastRow  = lastRow;
+        epicsEventSignal(workers_[i-1].startEventId);
+    }
+    computeRows(0, 0, rowsPerThread + ((extraRows > 0) ? 1 : 0));
+    for (i=1; i<numThreads; i++) {
+        epicsEventWait(workers_[i-1].doneEventId);
+    }
+}
+
+/** Template function to prepare the linear ramp image */
 template <typename epicsType> int simDetector::computeLinearRampArray(int sizeX, int sizeY)
+{
+    int colorMode = params_.colorMode;
+
+    imageAttributes_.add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+    return asynSuccess;
+}
+
+/** Template function to update rows [firstRow, lastRow) of the linear ramp.
+  * \param[in] firstRow First row to update.
+  * \param[in] lastRow One past the last row to update.
+  * \param[in,out] pData The full size image that holds the ramp. */
+template <typename epicsType, int colorMode> void simDetector::computeLinearRampRows(int firstRow, int lastRow,
+                                                                                     epicsType *pData)
 {
     epicsType *pMono=NULL, *pRed=NULL, *pGreen=NULL, *pBlue=NULL;
-    int columnStep=0, rowStep=0, colorMode;
-    epicsType incMono, incRed, incGreen, incBlue;
-    int status = asynSuccess;
-    double gain, gainX, gainY, gainRed, gainGreen, gainBlue;
-    int resetImage;
+    int columnStep=0, rowStep=0;
+    int sizeX = sizeX_, sizeY = sizeY_;
+    epicsType incMono, incRed, incGreen, incBlue, incRGB[3];
+    double gainX = params_.gainX, gainY = params_.gainY;
     int i, j;
-    epicsType* pRawData = (epicsType*)pRaw_->pData;
-    epicsType* pRampData = (epicsType*)pRamp_->pData;
-    epicsType *pData;
-
-    status = getDoubleParam (ADGain,        &gain);
-    status = getDoubleParam (SimGainX,      &gainX);
-    status = getDoubleParam (SimGainY,      &gainY);
-    status = getDoubleParam (SimGainRed,    &gainRed);
-    status = getDoubleParam (SimGainGreen,  &gainGreen);
-    status = getDoubleParam (SimGainBlue,   &gainBlue);
-    status = getIntegerParam(SimResetImage, &resetImage);
-    status = getIntegerParam(NDColorMode,   &colorMode);
+    size_t numElements = (size_t)(lastRow - firstRow) * sizeX;
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
 
     /* The intensity at each pixel[i,j] is:
      * (i * gainX + j* gainY) + imageCounter * gain */
-    incMono  = (epicsType) (gain);
-    incRed   = (epicsType) gainRed   * incMono;
-    incGreen = (epicsType) gainGreen * incMono;
-    incBlue  = (epicsType) gainBlue  * incMono;
-
-    if (useBackground_) {
-        pData = pRampData;
-    } else {
-        pData = pRawData;
-    }
+    incMono  = (epicsType) (params_.gain);
+    incRed   = (epicsType) params_.gainRed   * incMono;
+    incGreen = (epicsType) params_.gainGreen * incMono;
+    incBlue  = (epicsType) params_.gainBlue  * incMono;
 
     switch (colorMode) {
         case NDColorModeMono:
-            pMono = pData;
+            pMono = pData + firstRow*sizeX;
             break;
         case NDColorModeRGB1:
             columnStep = 3;
             rowStep = 0;
-            pRed   = pData;
-            pGreen = pData+1;
-            pBlue  = pData+2;
+            pRed   = pData + 3*firstRow*sizeX;
+            pGreen = pRed + 1;
+            pBlue  = pRed + 2;
             break;
         case NDColorModeRGB2:
             columnStep = 1;
             rowStep = 2 * sizeX;
-            pRed   = pData;
-            pGreen = pData + sizeX;
-            pBlue  = pData + 2*sizeX;
+            pRed   = pData + 3*firstRow*sizeX;
+            pGreen = pRed + sizeX;
+            pBlue  = pRed + 2*sizeX;
             break;
         case NDColorModeRGB3:
             columnStep = 1;
             rowStep = 0;
-            pRed   = pData;
-            pGreen = pData + sizeX*sizeY;
-            pBlue  = pData + 2*sizeX*sizeY;
+            pRed   = pData + firstRow*sizeX;
+            pGreen = pRed + sizeX*sizeY;
+            pBlue  = pRed + 2*sizeX*sizeY;
             break;
     }
-    pRaw_->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
 
-    if (resetImage) {
-        for (i=0; i<sizeY; i++) {
+    if (params_.dirty & SimDirtyRamp) {
+        for (i=firstRow; i<lastRow; i++) {
             switch (colorMode) {
                 case NDColorModeMono:
                     for (j=0; j<sizeX; j++) {
@@ -196,303 +697,291 @@ template <typename epicsType> int simDetector::computeLinearRampArray(int sizeX,
             }
         }
     } else {
-        for (i=0; i<sizeY; i++) {
-            switch (colorMode) {
-                case NDColorModeMono:
-                    for (j=0; j<sizeX; j++) {
-                            *pMono++ += incMono;
-                    }
-                    break;
-                case NDColorModeRGB1:
-                case NDColorModeRGB2:
-                case NDColorModeRGB3:
-                    for (j=0; j<sizeX; j++) {
-                        *pRed   += incRed;
-                        *pGreen += incGreen;
-                        *pBlue  += incBlue;
-                        pRed   += columnStep;
-                        pGreen += columnStep;
-                        pBlue  += columnStep;
-                    }
-                    pRed   += rowStep;
-                    pGreen += rowStep;
-                    pBlue  += rowStep;
-                    break;
-            }
-        }
-    }
-    if (useBackground_) {
-        for (i=0; i<arrayInfo_.nElements; i++) {
-            pRawData[i] += pRampData[i];
+        /* Each color plane row is contiguous except in RGB1, which has its own kernel */
+        switch (colorMode) {
+            case NDColorModeMono:
+                pKernels->addConstant(pMono, numElements, incMono);
+                break;
+            case NDColorModeRGB1:
+                incRGB[0] = incRed;
+                incRGB[1] = incGreen;
+                incRGB[2] = incBlue;
+                pKernels->addConstantRGB1(pRed, numElements, incRGB);
+                break;
+            case NDColorModeRGB2:
+                for (i=firstRow; i<lastRow; i++) {
+                    pKernels->addConstant(pRed,   sizeX, incRed);
+                    pKernels->addConstant(pGreen, sizeX, incGreen);
+                    pKernels->addConstant(pBlue,  sizeX, incBlue);
+                    pRed   += 3*sizeX;
+                    pGreen += 3*sizeX;
+                    pBlue  += 3*sizeX;
+                }
+                break;
+            case NDColorModeRGB3:
+                pKernels->addConstant(pRed,   numElements, incRed);
+                pKernels->addConstant(pGreen, numElements, incGreen);
+                pKernels->addConstant(pBlue,  numElements, incBlue);
+                break;
         }
     }
-    return(status);
 }
 
-/** Compute array for array of peaks */
+/** Template function to prepare the array of peaks image.
+  * Computes the peak profile when the image is reset, and the random height variation of each peak. */
 template <typename epicsType> int simDetector::computePeaksArray(int sizeX, int sizeY)
 {
-    epicsType *pRed=NULL, *pGreen=NULL, *pBlue=NULL;
-    int colorMode;
-    int peaksStartX, peaksStartY, peaksStepX, peaksStepY;
-    int peaksNumX, peaksNumY, peaksWidthX, peaksWidthY;
-    int peakFullWidthX, peakFullWidthY;
-    int status = asynSuccess;
-    int i,j,k,l;
-    int xOut, yOut;
-    int offsetX, offsetY;
-    double peakVariation;
-    int resetImage;
-    double gain, gainVariation, gainRed, gainGreen, gainBlue;
-    epicsType *pPeakData = (epicsType*)pPeak_->pData;
-    epicsType *pRawData = (epicsType*)pRaw_->pData;
-    epicsType *pIn, *pOut;
-
-    status = getIntegerParam(NDColorMode,   &colorMode);
-    status = getDoubleParam (ADGain,        &gain);
-    status = getDoubleParam (SimGainRed,    &gainRed);
-    status = getDoubleParam (SimGainGreen,  &gainGreen);
-    status = getDoubleParam (SimGainBlue,   &gainBlue);
-    status = getIntegerParam (SimPeakStartX,  &peaksStartX);
-    status = getIntegerParam (SimPeakStartY,  &peaksStartY);
-    status = getIntegerParam (SimPeakStepX,  &peaksStepX);
-    status = getIntegerParam (SimPeakStepY,  &peaksStepY);
-    status = getIntegerParam (SimPeakNumX,  &peaksNumX);
-    status = getIntegerParam (SimPeakNumY,  &peaksNumY);
-    status = getIntegerParam (SimPeakWidthX,  &peaksWidthX);
-    status = getIntegerParam (SimPeakWidthY,  &peaksWidthY);
-    status = getDoubleParam (SimPeakHeightVariation,  &peakVariation);
-    status = getIntegerParam(SimResetImage, &resetImage);
-
-    peakFullWidthX = ((2 * MAX_PEAK_SIGMA * peaksWidthX + 1) < sizeX) ? (2 * MAX_PEAK_SIGMA * peaksWidthX + 1) : (sizeX - 1);
-    peakFullWidthY = ((2 * MAX_PEAK_SIGMA * peaksWidthY + 1) < sizeY) ? (2 * MAX_PEAK_SIGMA * peaksWidthY + 1) : (sizeY - 1);
-
-    if (resetImage) {
-        // Compute a 2-D Gaussian according to parameters
-        double gaussX, gaussY;
-        for (i=0; i<peakFullWidthY; i++) {
-            pOut = pPeakData + (i * sizeX);
-            for (j=0; j<peakFullWidthX; j++) {
-                gaussY = exp( -pow((double)(i-peakFullWidthY/2)/(double)peaksWidthY,2.0)/2.0 );
-                gaussX = exp( -pow((double)(j-peakFullWidthX/2)/(double)peaksWidthX,2.0)/2.0 );
-                *pOut++ = (epicsType)(gain * gaussX * gaussY);
+    int colorMode = params_.colorMode;
+    int peaksNumX = params_.peakNumX, peaksNumY = params_.peakNumY;
+    int peaksWidthX = params_.peakWidthX, peaksWidthY = params_.peakWidthY;
+    double peakVariation = params_.peakVariation;
+    double gain = params_.gain;
+    int i, j;
+    epicsType *pOut;
+
+    if (params_.dirty & SimDirtyPeaks) {
+        peakFullWidthX_ = ((2 * MAX_PEAK_SIGMA * peaksWidthX + 1) < sizeX) ? (2 * MAX_PEAK_SIGMA * peaksWidthX + 1) : (sizeX - 1);
+        peakFullWidthY_ = ((2 * MAX_PEAK_SIGMA * peaksWidthY + 1) < sizeY) ? (2 * MAX_PEAK_SIGMA * peaksWidthY + 1) : (sizeY - 1);
+        if (peakFullWidthX_ < 0) peakFullWidthX_ = 0;
+        if (peakFullWidthY_ < 0) peakFullWidthY_ = 0;
+
+        // Compute a 2-D Gaussian according to parameters, as the product of the X and Y profiles
+        std::vector<double> gaussX(peakFullWidthX_), gaussY(peakFullWidthY_);
+        for (j=0; j<peakFullWidthX_; j++) {
+            gaussX[j] = exp( -pow((double)(j-peakFullWidthX_/2)/(double)peaksWidthX,2.0)/2.0 );
+        }
+        for (i=0; i<peakFullWidthY_; i++) {
+            gaussY[i] = exp( -pow((double)(i-peakFullWidthY_/2)/(double)peaksWidthY,2.0)/2.0 );
+        }
+        peakProfile_.resize(peakFullWidthX_ * peakFullWidthY_ * sizeof(epicsType));
+        pOut = (epicsType *)&peakProfile_[0];
+        for (i=0; i<peakFullWidthY_; i++) {
+            for (j=0; j<peakFullWidthX_; j++) {
+                *pOut++ = (epicsType)(gain * gaussX[j] * gaussY[i]);
             }
         }
     }
 
-    pRaw_->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+    imageAttributes_.add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
+
+    /* Each peak has its own random height variation, so it does not depend on how the rows are split between
+     * threads */
+    peakGainVariation_.resize(((peaksNumX > 0) && (peaksNumY > 0)) ? peaksNumX * peaksNumY : 0);
     for (i=0; i<peaksNumY; i++) {
         for (j=0; j<peaksNumX; j++) {
             if (peakVariation != 0) {
-                gainVariation = (1.0 + ((peakVariation / 100.0) * (((rand() / (double)RAND_MAX)) - 0.5)));
+                peakGainVariation_[i*peaksNumX + j] = (1.0 + ((peakVariation / 100.0) *
+                    (simRandomUniform(params_.noiseSeed, SIM_RANDOM_COUNTER(SimRandomPeakVariation,
+                        randomFrame_ * peakGainVariation_.size() + i*peaksNumX + j)) - 0.5)));
             }
             else {
-                gainVariation = 1.0;
+                peakGainVariation_[i*peaksNumX + j] = 1.0;
             }
-            offsetY = i * peaksStepY + peaksStartY;
+        }
+    }
+
+    return asynSuccess;
+}
+
+/** Template function to add the peaks to the window columns of one image row.
+  * The columns of each peak that fall in the window are found once per peak, so the loops over the columns have
+  * no tests.
+  * The arguments are the same as for computeRow(). */
+template <typename epicsType, int colorMode> void simDetector::computePeaksRow(int row, epicsType *pOut,
+                                                                               size_t colorStride)
+{
+    int peaksStartX = params_.peakStartX, peaksStartY = params_.peakStartY;
+    int peaksStepX = params_.peakStepX, peaksStepY = params_.peakStepY;
+    int peaksNumX = params_.peakNumX, peaksNumY = params_.peakNumY;
+    int peakFullWidthX = peakFullWidthX_, peakFullWidthY = peakFullWidthY_;
+    int xStride = (colorMode == NDColorModeRGB1) ? 3 : 1;
+    int i,j,k;
+    int firstL, lastL;
+    int offsetX, offsetY;
+    double gainVariation, scaleRGB[3];
+    double gainRed = params_.gainRed, gainGreen = params_.gainGreen, gainBlue = params_.gainBlue;
+    epicsType *pIn, *pPixel;
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+
+    if (peakFullWidthX <= 0) return;
+    for (i=0; i<peaksNumY; i++) {
+        // The row of the peak profile that falls on this image row
+        offsetY = i * peaksStepY + peaksStartY;
+        k = row - offsetY + peakFullWidthY/2;
+        if ((k < 0) || (k >= peakFullWidthY)) continue;
+        for (j=0; j<peaksNumX; j++) {
+            gainVariation = peakGainVariation_[i*peaksNumX + j];
             offsetX = j * peaksStepX + peaksStartX;
+            // The columns [firstL, lastL) of the peak profile that fall in the window
+            firstL = windowMinX_ - offsetX + peakFullWidthX/2;
+            lastL  = windowMaxX_ - offsetX + peakFullWidthX/2;
+            if (firstL < 0) firstL = 0;
+            if (lastL > peakFullWidthX) lastL = peakFullWidthX;
+            if (firstL >= lastL) continue;
+            pIn = (epicsType *)&peakProfile_[0] + k * peakFullWidthX;
+            pPixel = pOut + (offsetX + firstL - peakFullWidthX/2 - windowMinX_) * xStride;
             if (colorMode == NDColorModeMono) {
-                for (k=0; k<peakFullWidthY; k++) {
-                    pIn = pPeakData + k * sizeX;
-                    yOut = offsetY + k - peakFullWidthY/2;
-                    if ((yOut < 0) || (yOut >= sizeY)) continue;
-                    pOut = pRawData + yOut * sizeX;
-                    for (l=0; l<peakFullWidthX; l++, pIn++) {
-                        xOut = offsetX + l - peakFullWidthX/2;
-                        if ((xOut < 0) || (xOut >= sizeX)) continue;
-                        pOut[xOut] += gainVariation * *pIn;
-                    }
-                }
+                pKernels->addScaledArray(pPixel, pIn + firstL, gainVariation, lastL - firstL);
+                continue;
+            }
+            /* The color stamp rounds each scaled profile element before adding it, rather than the sum as in Mono
+             * mode, so it has its own kernels */
+            scaleRGB[0] = gainRed   * gainVariation;
+            scaleRGB[1] = gainGreen * gainVariation;
+            scaleRGB[2] = gainBlue  * gainVariation;
+            if (colorMode == NDColorModeRGB1) {
+                pKernels->addPeakRowRGB1(pPixel, pIn + firstL, scaleRGB, lastL - firstL);
             } else {
-                for (k=0; k<peakFullWidthY; k++) {
-                    //Move to the starting point for this peak
-                    pIn = pPeakData + k * sizeX;
-                    yOut = offsetY + k - peakFullWidthY/2;
-                    if ((yOut < 0) || (yOut >= sizeY)) continue;
-                    int columnStep = 1;
-                    switch (colorMode) {
-                        case NDColorModeRGB1:
-                            columnStep = 3;
-                            pRed = pRawData + 3 * yOut * sizeX;
-                            pGreen = pRed + 1;
-                            pBlue = pRed + 2;
-                            break;
-                        case NDColorModeRGB2:
-                            pRed = pRawData + 3 * yOut * sizeX;
-                            pGreen = pRed + sizeX;
-                            pBlue = pRed + 2 * sizeX;
-                            break;
-                        case NDColorModeRGB3:
-                            pRed = pRawData + yOut * sizeX;
-                            pGreen = pRed + sizeX * sizeY;
-                            pBlue = pRed + 2 * sizeX * sizeY;
-                            break;
-                    }
-                    //Fill in a row for this peak
-                    for (l=0; l<peakFullWidthX; l++, pIn++) {
-                        xOut = offsetX + l - peakFullWidthX/2;
-                        if ((xOut < 0) || (xOut >= sizeX)) continue;
-                        xOut *= columnStep;
-                        pRed[xOut]   += (epicsType)(gainRed   * gainVariation * *pIn);
-                        pGreen[xOut] += (epicsType)(gainGreen * gainVariation * *pIn);
-                        pBlue[xOut]  += (epicsType)(gainBlue  * gainVariation * *pIn);
-                    }
-                }
+                pKernels->addPeakRow(pPixel,                 pIn + firstL, scaleRGB[0], lastL - firstL);
+                pKernels->addPeakRow(pPixel + colorStride,   pIn + firstL, scaleRGB[1], lastL - firstL);
+                pKernels->addPeakRow(pPixel + 2*colorStride, pIn + firstL, scaleRGB[2], lastL - firstL);
             }
         }
     }
+}
 
-    return status;
+/** Computes pSine[i] = amplitude * sin(((counter + i) * gain / size * frequency + phase/360) * 2 pi)
+  * for i in [first, last).  sin() is only called for the elements that are multiples of SIM_SINE_ANCHOR.  From each
+  * of these the angle addition formulas advance the sine and cosine by the constant angle between elements, which
+  * needs 4 multiplications.  The value of each element therefore does not depend on first and last. */
+static void computeSineWave(double *pSine, int first, int last, double counter, double gain, int size,
+                            double amplitude, double frequency, double phase)
+{
+    double delta = gain / size * frequency * 2. * M_PI;
+    double cosDelta = cos(delta), sinDelta = sin(delta);
+    double angle, sinAngle, cosAngle, temp;
+    int i, anchor, end;
+
+    for (anchor=first - first % SIM_SINE_ANCHOR; anchor<last; anchor+=SIM_SINE_ANCHOR) {
+        angle = ((counter + anchor) * gain / size * frequency + phase/360.) * 2. * M_PI;
+        sinAngle = sin(angle);
+        cosAngle = cos(angle);
+        end = (last - anchor < SIM_SINE_ANCHOR) ? last : anchor + SIM_SINE_ANCHOR;
+        for (i=anchor; i<end; i++) {
+            if (i >= first) pSine[i] = amplitude * sinAngle;
+            temp     = sinAngle * cosDelta + cosAngle * sinDelta;
+            cosAngle = cosAngle * cosDelta - sinAngle * sinDelta;
+            sinAngle = temp;
+        }
+    }
 }
 
-/** Template function to compute the simulated detector data for any data type */
+/** Template function to prepare the sine wave image.
+  * Computes the X and Y sine waves for the window of this image. */
 template <typename epicsType> int simDetector::computeSineArray(int sizeX, int sizeY)
 {
-    epicsType *pMono=NULL, *pRed=NULL, *pGreen=NULL, *pBlue=NULL;
-    int columnStep=0, rowStep=0, colorMode;
-    int status = asynSuccess;
-    int xSineOperation, ySineOperation;
-    double exposureTime, gain, gainX, gainY, gainRed, gainGreen, gainBlue;
-    double xSine1Amplitude, xSine1Frequency, xSine1Phase;
-    double xSine2Amplitude, xSine2Frequency, xSine2Phase;
-    double ySine1Amplitude, ySine1Frequency, ySine1Phase;
-    double ySine2Amplitude, ySine2Frequency, ySine2Phase;
-    double xTime, yTime;
-    int resetImage;
-    int i, j;
+    int colorMode = params_.colorMode;
+    double gainX = params_.gainX, gainY = params_.gainY;
+    int minX = windowMinX_, maxX = windowMaxX_;
+    int minY = windowMinY_, maxY = windowMaxY_;
+    int i;
+    const simFrameParams_t *p = &params_;
 
-    status = getDoubleParam (ADGain,            &gain);
-    status = getDoubleParam (SimGainX,          &gainX);
-    status = getDoubleParam (SimGainY,          &gainY);
-    status = getDoubleParam (SimGainRed,        &gainRed);
-    status = getDoubleParam (SimGainGreen,      &gainGreen);
-    status = getDoubleParam (SimGainBlue,       &gainBlue);
-    status = getIntegerParam(SimResetImage,     &resetImage);
-    status = getIntegerParam(NDColorMode,       &colorMode);
-    status = getDoubleParam (ADAcquireTime,     &exposureTime);
-    status = getIntegerParam(SimXSineOperation, &xSineOperation);
-    status = getDoubleParam(SimXSine1Amplitude, &xSine1Amplitude);
-    status = getDoubleParam(SimXSine1Frequency, &xSine1Frequency);
-    status = getDoubleParam(SimXSine1Phase,     &xSine1Phase);
-    status = getDoubleParam(SimXSine2Amplitude, &xSine2Amplitude);
-    status = getDoubleParam(SimXSine2Frequency, &xSine2Frequency);
-    status = getDoubleParam(SimXSine2Phase,     &xSine2Phase);
-    status = getIntegerParam(SimYSineOperation, &ySineOperation);
-    status = getDoubleParam(SimYSine1Amplitude, &ySine1Amplitude);
-    status = getDoubleParam(SimYSine1Frequency, &ySine1Frequency);
-    status = getDoubleParam(SimYSine1Phase,     &ySine1Phase);
-    status = getDoubleParam(SimYSine2Amplitude, &ySine2Amplitude);
-    status = getDoubleParam(SimYSine2Frequency, &ySine2Frequency);
-    status = getDoubleParam(SimYSine2Phase,     &ySine2Phase);
+    imageAttributes_.add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
 
-    switch (colorMode) {
-        case NDColorModeMono:
-            pMono = (epicsType *)pRaw_->pData;
-            break;
-        case NDColorModeRGB1:
-            columnStep = 3;
-            rowStep = 0;
-            pRed   = (epicsType *)pRaw_->pData;
-            pGreen = (epicsType *)pRaw_->pData+1;
-            pBlue  = (epicsType *)pRaw_->pData+2;
-            break;
-        case NDColorModeRGB2:
-            columnStep = 1;
-            rowStep = 2 * sizeX;
-            pRed   = (epicsType *)pRaw_->pData;
-            pGreen = (epicsType *)pRaw_->pData + sizeX;
-            pBlue  = (epicsType *)pRaw_->pData + 2*sizeX;
-            break;
-        case NDColorModeRGB3:
-            columnStep = 1;
-            rowStep = 0;
-            pRed   = (epicsType *)pRaw_->pData;
-            pGreen = (epicsType *)pRaw_->pData + sizeX*sizeY;
-            pBlue  = (epicsType *)pRaw_->pData + 2*sizeX*sizeY;
-            break;
-    }
-    pRaw_->pAttributeList->add("ColorMode", "Color mode", NDAttrInt32, &colorMode);
-
-    if (resetImage) {
-      if (xSine1_) free(xSine1_);
-      if (xSine2_) free(xSine2_);
-      if (ySine1_) free(ySine1_);
-      if (ySine2_) free(ySine2_);
-      xSine1_ = (double *)calloc(sizeX, sizeof(double));
-      xSine2_ = (double *)calloc(sizeX, sizeof(double));
-      ySine1_ = (double *)calloc(sizeY, sizeof(double));
-      ySine2_ = (double *)calloc(sizeY, sizeof(double));
+    if (p->dirty & SimDirtySine) {
+      xSine1_.resize(sizeX);
+      xSine2_.resize(sizeX);
+      ySine1_.resize(sizeY);
+      ySine2_.resize(sizeY);
       xSineCounter_ = 0;
       ySineCounter_ = 0;
     }
 
-    for (i=0; i<sizeX; i++) {
-        xTime = xSineCounter_++ * gainX / sizeX;
-        xSine1_[i] = xSine1Amplitude * sin((xTime  * xSine1Frequency + xSine1Phase/360.) * 2. * M_PI);
-        xSine2_[i] = xSine2Amplitude * sin((xTime  * xSine2Frequency + xSine2Phase/360.) * 2. * M_PI);
-    }
-    for (i=0; i<sizeY; i++) {
-        yTime = ySineCounter_++ * gainY / sizeY;
-        ySine1_[i] = ySine1Amplitude * sin((yTime  * ySine1Frequency + ySine1Phase/360.) * 2. * M_PI);
-        ySine2_[i] = ySine2Amplitude * sin((yTime  * ySine2Frequency + ySine2Phase/360.) * 2. * M_PI);
+    /* The counters advance by the full image size for each image, so the values in the window
+     * do not depend on the window */
+    computeSineWave(&xSine1_[0], minX, maxX, xSineCounter_, gainX, sizeX,
+                    p->xSine1Amplitude, p->xSine1Frequency, p->xSine1Phase);
+    computeSineWave(&xSine2_[0], minX, maxX, xSineCounter_, gainX, sizeX,
+                    p->xSine2Amplitude, p->xSine2Frequency, p->xSine2Phase);
+    computeSineWave(&ySine1_[0], minY, maxY, ySineCounter_, gainY, sizeY,
+                    p->ySine1Amplitude, p->ySine1Frequency, p->ySine1Phase);
+    computeSineWave(&ySine2_[0], minY, maxY, ySineCounter_, gainY, sizeY,
+                    p->ySine2Amplitude, p->ySine2Frequency, p->ySine2Phase);
+    xSineCounter_ += sizeX;
+    ySineCounter_ += sizeY;
+
+    /* In RGB1 mode red is XSine1 and blue is XSine2 plus YSine2, and green does not depend on X */
+    if (colorMode == NDColorModeRGB1) {
+        xSineRGB1_.resize(3 * sizeX);
+        for (i=minX; i<maxX; i++) {
+            xSineRGB1_[3*i]   = xSine1_[i];
+            xSineRGB1_[3*i+1] = 0.;
+            xSineRGB1_[3*i+2] = xSine2_[i];
+        }
     }
 
     if (colorMode == NDColorModeMono) {
-        if (xSineOperation == SimSineOperationAdd) {
-            for (i=0; i<sizeX; i++) {
+        if (p->xSineOperation == SimSineOperationAdd) {
+            for (i=minX; i<maxX; i++) {
                 xSine1_[i] = xSine1_[i] + xSine2_[i];
             }
         }
         else {
-            for (i=0; i<sizeX; i++) {
+            for (i=minX; i<maxX; i++) {
                 xSine1_[i] = xSine1_[i] * xSine2_[i];
             }
         }
-        if (ySineOperation == SimSineOperationAdd) {
-            for (i=0; i<sizeY; i++) {
+        if (p->ySineOperation == SimSineOperationAdd) {
+            for (i=minY; i<maxY; i++) {
                 ySine1_[i] = ySine1_[i] + ySine2_[i];
             }
         }
         else {
-            for (i=0; i<sizeY; i++) {
+            for (i=minY; i<maxY; i++) {
                 ySine1_[i] = ySine1_[i] * ySine2_[i];
             }
         }
     }
-    for (i=0; i<sizeY; i++) {
-        switch (colorMode) {
-            case NDColorModeMono:
-                for (j=0; j<sizeX; j++) {
-                    *pMono++ += (epicsType) (gain * (ySine1_[i] + xSine1_[j]));
-                }
-                break;
-            case NDColorModeRGB1:
-            case NDColorModeRGB2:
-            case NDColorModeRGB3:
-                for (j=0; j<sizeX; j++) {
-                    *pRed   += (epicsType)(gain * gainRed   * xSine1_[j]);
-                    *pGreen += (epicsType)(gain * gainGreen * ySine1_[i]);
-                    *pBlue  += (epicsType)(gain * gainBlue  * (xSine2_[j] + ySine2_[i])/2.);
-                    pRed   += columnStep;
-                    pGreen += columnStep;
-                    pBlue  += columnStep;
-                }
-                pRed   += rowStep;
-                pGreen += rowStep;
-                pBlue  += rowStep;
-                break;
-        }
-    }
-    return(status);
+    return asynSuccess;
 }
 
-/** Controls the shutter */
-void simDetector::setShutter(int open)
+/** Template function to add the sine waves to the window columns of one image row.
+  * Each image row is the sum of a function of X and a value for the row, so the rows are computed with the vector
+  * kernels.
+  * The arguments are the same as for computeRow(). */
+template <typename epicsType, int colorMode> void simDetector::computeSineRow(int row, epicsType *pOut,
+                                                                              size_t colorStride)
 {
-    int shutterMode;
-
-    getIntegerParam(ADShutterMode, &shutterMode);
-    if (shutterMode == ADShutterModeDetector) {
+    epicsType *pRed, *pGreen, *pBlue;
+    int minX = windowMinX_, maxX = windowMaxX_;
+    double gain = params_.gain;
+    double gainRed = params_.gainRed, gainGreen = params_.gainGreen, gainBlue = params_.gainBlue;
+    double yRGB[3], gainRGB[3];
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+
+    /* Halving the blue gain rather than the product gives the same result, because it only changes the exponent */
+    switch (colorMode) {
+        case NDColorModeMono:
+            pKernels->addSineRow(pOut, &xSine1_[minX], ySine1_[row], gain, maxX - minX);
+            break;
+        case NDColorModeRGB1:
+            yRGB[0] = 0.;
+            yRGB[1] = ySine1_[row];
+            yRGB[2] = ySine2_[row];
+            gainRGB[0] = gain * gainRed;
+            gainRGB[1] = gain * gainGreen;
+            gainRGB[2] = gain * gainBlue / 2.;
+            pKernels->addSineRowRGB1(pOut, &xSineRGB1_[3*minX], yRGB, gainRGB, maxX - minX);
+            break;
+        default:
+            pRed   = pOut;
+            pGreen = pOut + colorStride;
+            pBlue  = pOut + 2*colorStride;
+            pKernels->addSineRow(pRed, &xSine1_[minX], 0., gain * gainRed, maxX - minX);
+            pKernels->addConstant(pGreen, maxX - minX, (epicsType)(gain * gainGreen * ySine1_[row]));
+            pKernels->addSineRow(pBlue, &xSine2_[minX], ySine2_[row], gain * gainBlue / 2., maxX - minX);
+            break;
+    }
+}
+
+/** Controls the shutter */
+void simDetector::setShutter(int open)
+{
+    int shutterMode;
+
+    getIntegerParam(ADShutterMode, &shutterMode);
+    if (shutterMode == ADShutterModeDetector) {
         /* Simulate a shutter by just changing the status readback */
         setIntegerParam(ADShutterStatus, open);
     } else {
@@ -501,193 +990,904 @@ void simDetector::setShutter(int open)
     }
 }
 
-/** Computes the new image data */
-int simDetector::computeImage()
+/** Computes the new image data */
+int simDetector::computeImage()
+{
+    int status = asynSuccess;
+    NDDataType_t dataType;
+    int itemp;
+    int binX, binY, minX, minY, sizeX, sizeY, reverseX, reverseY;
+    int xDim=0, yDim=1, colorDim=-1;
+    int resetImage, dirty;
+    int maxSizeX, maxSizeY;
+    int colorMode;
+    int replayFrames;
+    int ndims=0;
+    size_t dims[3];
+    NDArrayInfo_t arrayInfo;
+    NDArray *pImage;
+    NDArray *pFrame;
+    const char* functionName = "computeImage";
+
+    /* NOTE: The caller of this function must have taken the mutex.
+     * It is released while the image is computed. */
+
+    status |= getIntegerParam(ADBinX,         &binX);
+    status |= getIntegerParam(ADBinY,         &binY);
+    status |= getIntegerParam(ADMinX,         &minX);
+    status |= getIntegerParam(ADMinY,         &minY);
+    status |= getIntegerParam(ADSizeX,        &sizeX);
+    status |= getIntegerParam(ADSizeY,        &sizeY);
+    status |= getIntegerParam(ADReverseX,     &reverseX);
+    status |= getIntegerParam(ADReverseY,     &reverseY);
+    status |= getIntegerParam(ADMaxSizeX,     &maxSizeX);
+    status |= getIntegerParam(ADMaxSizeY,     &maxSizeY);
+    status |= getIntegerParam(NDColorMode,    &colorMode);
+    status |= getIntegerParam(NDDataType,     &itemp); dataType = (NDDataType_t)itemp;
+    status |= getIntegerParam(SimResetImage,  &resetImage);
+    status |= getIntegerParam(SimReplayFrames, &replayFrames);
+    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: error getting parameters\n",
+                    driverName, functionName);
+    /* SimResetImage recomputes everything, otherwise only what depends on the parameters that have changed */
+    dirty = dirty_ | (resetImage ? SIM_DIRTY_ALL : 0);
+
+    /* Make sure parameters are consistent, fix them if they are not */
+    if (binX < 1) {
+        binX = 1;
+        status |= setIntegerParam(ADBinX, binX);
+    }
+    if (binY < 1) {
+        binY = 1;
+        status |= setIntegerParam(ADBinY, binY);
+    }
+    if (minX < 0) {
+        minX = 0;
+        status |= setIntegerParam(ADMinX, minX);
+    }
+    if (minY < 0) {
+        minY = 0;
+        status |= setIntegerParam(ADMinY, minY);
+    }
+    if (minX > maxSizeX-1) {
+        minX = maxSizeX-1;
+        status |= setIntegerParam(ADMinX, minX);
+    }
+    if (minY > maxSizeY-1) {
+        minY = maxSizeY-1;
+        status |= setIntegerParam(ADMinY, minY);
+    }
+    if (minX+sizeX > maxSizeX) {
+        sizeX = maxSizeX-minX;
+        status |= setIntegerParam(ADSizeX, sizeX);
+    }
+    if (minY+sizeY > maxSizeY) {
+        sizeY = maxSizeY-minY;
+        status |= setIntegerParam(ADSizeY, sizeY);
+    }
+
+    switch (colorMode) {
+        case NDColorModeMono:
+            ndims = 2;
+            xDim = 0;
+            yDim = 1;
+            break;
+        case NDColorModeRGB1:
+            ndims = 3;
+            colorDim = 0;
+            xDim     = 1;
+            yDim     = 2;
+            break;
+        case NDColorModeRGB2:
+            ndims = 3;
+            colorDim = 1;
+            xDim     = 0;
+            yDim     = 2;
+            break;
+        case NDColorModeRGB3:
+            ndims = 3;
+            colorDim = 2;
+            xDim     = 0;
+            yDim     = 1;
+            break;
+    }
+
+    /* The images kept for replay can only be used if they would be computed with the same parameters */
+    if (!replayFrames_.empty()) {
+        pFrame = replayFrames_[0];
+        if (dirty || (replayFrames <= 0) ||
+            (pFrame->dataType != dataType) || (pFrame->ndims != ndims) ||
+            (pFrame->dims[xDim].offset != (size_t)minX) || (pFrame->dims[yDim].offset != (size_t)minY) ||
+            (pFrame->dims[xDim].size != (size_t)(sizeX/binX)) || (pFrame->dims[yDim].size != (size_t)(sizeY/binY)) ||
+            (pFrame->dims[xDim].binning != binX) || (pFrame->dims[yDim].binning != binY) ||
+            (pFrame->dims[xDim].reverse != reverseX) || (pFrame->dims[yDim].reverse != reverseY)) {
+            releaseReplayFrames();
+        }
+    }
+    if (!replayFrames_.empty()) {
+        replayFrames_[0]->getInfo(&arrayInfo);
+        while (replayFrames_.size() > replayCapacity(arrayInfo.totalBytes)) {
+            replayFrames_.back()->release();
+            replayFrames_.pop_back();
+        }
+        if (replayFrames_.size() == replayCapacity(arrayInfo.totalBytes)) return replayImage();
+    }
+
+    getFrameParams();
+    params_.dirty = dirty;
+
+    /* The output image is the region of interest with binning.
+     * Only the part of the region that is binned into the output image needs to be computed. */
+    params_.outSizeX = sizeX / binX;
+    params_.outSizeY = sizeY / binY;
+    if ((params_.outSizeX <= 0) || (params_.outSizeY <= 0)) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: image size is smaller than binning\n",
+                  driverName, functionName);
+        return(asynError);
+    }
+    params_.binX     = binX;
+    params_.binY     = binY;
+    params_.reverseX = reverseX;
+    params_.reverseY = reverseY;
+    windowMinX_ = minX;
+    windowMaxX_ = minX + params_.outSizeX * binX;
+    windowMinY_ = minY;
+    windowMaxY_ = minY + params_.outSizeY * binY;
+
+    if (dirty & SimDirtyBuffers) {
+        /* Free the previous work buffers.  computeArray() allocates the ones that the images need. */
+        releaseWorkBuffers();
+        bufferNDims_ = ndims;
+        bufferDims_[xDim] = maxSizeX;
+        bufferDims_[yDim] = maxSizeY;
+        if (ndims > 2) bufferDims_[colorDim] = 3;
+        bufferElements_ = (size_t)maxSizeX * maxSizeY * ((ndims > 2) ? 3 : 1);
+        imageAttributes_.clear();
+    }
+
+    dims[xDim] = params_.outSizeX;
+    dims[yDim] = params_.outSizeY;
+    if (ndims > 2) dims[colorDim] = 3;
+    pImage = this->pNDArrayPool->alloc(ndims, dims, dataType, 0, NULL);
+    if (!pImage) {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                  "%s:%s: error allocating image buffer\n",
+                  driverName, functionName);
+        return(asynError);
+    }
+    pImage->dims[xDim].offset  = minX;
+    pImage->dims[xDim].binning = binX;
+    pImage->dims[xDim].reverse = reverseX;
+    pImage->dims[yDim].offset  = minY;
+    pImage->dims[yDim].binning = binY;
+    pImage->dims[yDim].reverse = reverseY;
+    pImage_ = pImage;
+
+    /* The reset has been done, so clear the flags now.  If a parameter is changed while the image is being computed
+     * the flags will be set again and the next image will be reset. */
+    setIntegerParam(SimResetImage, 0);
+    dirty_ = 0;
+
+    /* Compute the image without holding the lock, so that parameters can be changed in the meantime.
+     * Only params_ and the buffers that belong to this thread are used while computing. */
+    status = asynSuccess;
+    this->unlock();
+    switch (dataType) {
+        case NDInt8:
+            status |= computeArray<epicsInt8>(maxSizeX, maxSizeY);
+            break;
+        case NDUInt8:
+            status |= computeArray<epicsUInt8>(maxSizeX, maxSizeY);
+            break;
+        case NDInt16:
+            status |= computeArray<epicsInt16>(maxSizeX, maxSizeY);
+            break;
+        case NDUInt16:
+            status |= computeArray<epicsUInt16>(maxSizeX, maxSizeY);
+            break;
+        case NDInt32:
+            status |= computeArray<epicsInt32>(maxSizeX, maxSizeY);
+            break;
+        case NDUInt32:
+            status |= computeArray<epicsUInt32>(maxSizeX, maxSizeY);
+            break;
+        case NDInt64:
+            status |= computeArray<epicsInt64>(maxSizeX, maxSizeY);
+            break;
+        case NDUInt64:
+            status |= computeArray<epicsUInt64>(maxSizeX, maxSizeY);
+            break;
+        case NDFloat32:
+            status |= computeArray<epicsFloat32>(maxSizeX, maxSizeY);
+            break;
+        case NDFloat64:
+            status |= computeArray<epicsFloat64>(maxSizeX, maxSizeY);
+            break;
+    }
+
+    /* The attributes are added to imageAttributes_ by computeArray() */
+    imageAttributes_.copy(pImage->pAttributeList);
+    pImage_ = NULL;
+    this->lock();
+    updateMemoryUse();
+    if (status) {
+        /* A work buffer could not be allocated, so try again for the next image */
+        dirty_ |= SIM_DIRTY_ALL;
+        pImage->release();
+        return(status);
+    }
+
+    /* We save the most recent image buffer so it can be used in the read() function.
+     * Now replace the previous one with it. */
+    if (this->pArrays[0]) this->pArrays[0]->release();
+    this->pArrays[0] = pImage;
+    pImage->getInfo(&arrayInfo);
+    status = asynSuccess;
+    status |= setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
+    status |= setIntegerParam(NDArraySizeX, (int)pImage->dims[xDim].size);
+    status |= setIntegerParam(NDArraySizeY, (int)pImage->dims[yDim].size);
+
+    /* Keep the image to publish again in replay mode */
+    if ((replayFrames > 0) && (replayFrames_.size() < replayCapacity(arrayInfo.totalBytes))) {
+        pImage->reserve();
+        replayFrames_.push_back(pImage);
+    }
+    status |= setIntegerParam(SimReplayNumFrames, (int)replayFrames_.size());
+    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: error setting parameters\n",
+                    driverName, functionName);
+    return(status);
+}
+
+/** Returns the number of images to keep for replay.
+  * This is SimReplayFrames, limited so that the images use no more than SimReplayMaxMemory MB, but at least 1.
+  * \param[in] imageBytes The size of each image in bytes. */
+size_t simDetector::replayCapacity(size_t imageBytes)
+{
+    int replayFrames, replayMaxMemory;
+    size_t capacity;
+
+    getIntegerParam(SimReplayFrames,    &replayFrames);
+    getIntegerParam(SimReplayMaxMemory, &replayMaxMemory);
+    if (replayFrames <= 0) return 0;
+    capacity = (size_t)replayMaxMemory * 1024 * 1024 / imageBytes;
+    if (capacity > (size_t)replayFrames) capacity = replayFrames;
+    if (capacity < 1) capacity = 1;
+    return capacity;
+}
+
+/** Releases the images kept for replay, so that the next images are computed again. */
+void simDetector::releaseReplayFrames()
+{
+    size_t i;
+
+    for (i=0; i<replayFrames_.size(); i++) {
+        replayFrames_[i]->release();
+    }
+    replayFrames_.clear();
+    replayIndex_ = 0;
+    setIntegerParam(SimReplayNumFrames, 0);
+}
+
+/** Records the duration of one stage of an image.  Called with the lock held.
+  * \param[in] stage The SimStage_t stage.
+  * \param[in] startTime The epicsMonotonicGet() time at which the stage started.
+  * \param[in] endTime The epicsMonotonicGet() time at which the stage ended. */
+void simDetector::recordStageTime(int stage, epicsUInt64 startTime, epicsUInt64 endTime)
+{
+    simStageTimes_t *pTimes = &stageTimes_[stage];
+
+    pTimes->samples[pTimes->next] = (endTime - startTime) * 1.e-6;
+    pTimes->next = (pTimes->next + 1) % SIM_STAGE_SAMPLES;
+    if (pTimes->count < SIM_STAGE_SAMPLES) pTimes->count++;
+}
+
+/** Discards the stage times of the previous acquisition, so the statistics are computed for the first image */
+void simDetector::clearStageTimes()
+{
+    int stage;
+
+    for (stage=0; stage<SimNumStages; stage++) {
+        stageTimes_[stage].next = 0;
+        stageTimes_[stage].count = 0;
+    }
+    stageUpdateTime_ = 0;
+}
+
+/** Waits until a time on the epicsMonotonicGet() clock, or until the acquisition is stopped.  Called without the
+  * lock.  epicsEventWaitWithTimeout() can return up to a clock tick late, so it is only used until spinTime before
+  * the deadline, and for the rest of the time this spins, polling the stop event.  This starts the images within
+  * microseconds of their deadlines, at the cost of using a CPU for up to spinTime per image.
+  * \param[in] deadline The epicsMonotonicGet() time to wait for.
+  * \param[in] spinTime The time before the deadline to start spinning, in seconds.
+  * \param[in] stoppable If false the stop event is not used, so that a thread other than simTask() can wait.
+  * \return epicsEventWaitOK if the acquisition was stopped, otherwise epicsEventWaitTimeout. */
+int simDetector::waitUntil(epicsUInt64 deadline, double spinTime, bool stoppable)
+{
+    epicsUInt64 spin = (spinTime > 0.) ? (epicsUInt64)(spinTime * 1.e9) : 0;
+    epicsUInt64 now = epicsMonotonicGet();
+    int status = epicsEventWaitTimeout;
+
+    while (now < deadline) {
+        if (deadline - now > spin) {
+            if (stoppable) {
+                status = epicsEventWaitWithTimeout(stopEventId_, (deadline - now - spin) * 1.e-9);
+            } else {
+                epicsThreadSleep((deadline - now - spin) * 1.e-9);
+            }
+        } else if (stoppable) {
+            status = epicsEventTryWait(stopEventId_);
+        }
+        if (status == epicsEventWaitOK) return status;
+        now = epicsMonotonicGet();
+    }
+    return stoppable ? epicsEventTryWait(stopEventId_) : status;
+}
+
+/** Sets SimFrameRate, SimDataRate and SimSubFrameRate to 0 and starts measuring the rates of a new acquisition.
+  * Called with the lock held. */
+void simDetector::clearRates()
+{
+    rateUpdateTime_ = epicsMonotonicGet();
+    rateFrames_ = 0;
+    rateBytes_ = 0.;
+    rateSubFrames_ = 0.;
+    ratesUpdated_ = false;
+    setDoubleParam(SimFrameRate, 0.);
+    setDoubleParam(SimDataRate, 0.);
+    setDoubleParam(SimSubFrameRate, 0.);
+}
+
+/** Counts a published image or batch of images, and if SIM_RATE_UPDATE_PERIOD has passed since the last update
+  * sets SimFrameRate and SimDataRate from the images and bytes published since then, and SimSubFrameRate from the
+  * images computed since then, which includes each sub-frame of a sum.  The rates are exponential moving averages,
+  * so they do not jump about with the phase of the updates relative to the images.
+  * Called with the lock held.
+  * \param[in] numFrames The number of images.
+  * \param[in] bytes The size of the images.
+  * \param[in] now The current epicsMonotonicGet() time. */
+void simDetector::updateRates(int numFrames, size_t bytes, epicsUInt64 now)
+{
+    double elapsed, frameRate, dataRate, subFrameRate, previous;
+
+    rateFrames_ += numFrames;
+    rateBytes_ += bytes;
+    if (now - rateUpdateTime_ < SIM_RATE_UPDATE_PERIOD) return;
+    elapsed = (now - rateUpdateTime_) * 1.e-9;
+    frameRate = rateFrames_ / elapsed;
+    dataRate = rateBytes_ / elapsed / (1024. * 1024.);
+    subFrameRate = rateSubFrames_ / elapsed;
+    /* The first rates of an acquisition are not averaged with the 0 set by clearRates() */
+    getDoubleParam(SimFrameRate, &previous);
+    if (previous > 0.) frameRate = previous + SIM_RATE_SMOOTHING * (frameRate - previous);
+    getDoubleParam(SimDataRate, &previous);
+    if (previous > 0.) dataRate = previous + SIM_RATE_SMOOTHING * (dataRate - previous);
+    getDoubleParam(SimSubFrameRate, &previous);
+    if (previous > 0.) subFrameRate = previous + SIM_RATE_SMOOTHING * (subFrameRate - previous);
+    setDoubleParam(SimFrameRate, frameRate);
+    setDoubleParam(SimDataRate, dataRate);
+    setDoubleParam(SimSubFrameRate, subFrameRate);
+    rateUpdateTime_ = now;
+    rateFrames_ = 0;
+    rateBytes_ = 0.;
+    rateSubFrames_ = 0.;
+    ratesUpdated_ = true;
+}
+
+/** Calls the parameter callbacks for the status and counters of the acquisition.  Unless force is true these
+  * are coalesced, and are only done if 1/SimStatusRate has passed since the last time, so that at high frame rates
+  * the time goes to computing and publishing the images rather than to the callbacks.  If SimStatusRate is 0 they
+  * are done every time.  Called with the lock held.
+  * \param[in] force If true the callbacks are always done. */
+void simDetector::flushStatus(bool force)
+{
+    double statusRate;
+    epicsUInt64 now = epicsMonotonicGet();
+
+    getDoubleParam(SimStatusRate, &statusRate);
+    if (!force && (statusRate > 0.) && (now - statusUpdateTime_ < (epicsUInt64)(1.e9 / statusRate))) return;
+    statusUpdateTime_ = now;
+    ratesUpdated_ = false;
+    callParamCallbacks();
+}
+
+/** Sets the stage time parameters to the mean, median, 99th percentile and maximum of the recent durations of
+  * each stage.  Finding the percentiles takes a few microseconds, so unless force is true this is only done if
+  * SIM_STAGE_UPDATE_PERIOD has passed since the last time.  Called with the lock held.
+  * \param[in] now The current epicsMonotonicGet() time.
+  * \param[in] force If true the statistics are always computed. */
+void simDetector::updateStageTimes(epicsUInt64 now, bool force)
+{
+    double sorted[SIM_STAGE_SAMPLES];
+    double sum, maximum;
+    int stage, count, param, i;
+
+    if (!force && stageUpdateTime_ && (now - stageUpdateTime_ < SIM_STAGE_UPDATE_PERIOD)) return;
+    stageUpdateTime_ = now;
+    for (stage=0; stage<SimNumStages; stage++) {
+        count = stageTimes_[stage].count;
+        param = FIRST_SIM_STAGE_TIME_PARAM + 4*stage;  // This assumes order in simDetector.h!
+        if (count == 0) {
+            for (i=0; i<4; i++) setDoubleParam(param + i, 0.);
+            continue;
+        }
+        memcpy(sorted, stageTimes_[stage].samples, count * sizeof(double));
+        sum = 0.;
+        maximum = 0.;
+        for (i=0; i<count; i++) {
+            sum += sorted[i];
+            if (sorted[i] > maximum) maximum = sorted[i];
+        }
+        /* The 99th percentile is the smallest duration that is not less than 99% of them */
+        i = (99*count + 99)/100 - 1;
+        std::nth_element(sorted, sorted + count/2, sorted + count);
+        std::nth_element(sorted + count/2, sorted + i, sorted + count);
+        setDoubleParam(param,     sum / count);
+        setDoubleParam(param + 1, sorted[count/2]);
+        setDoubleParam(param + 2, sorted[i]);
+        setDoubleParam(param + 3, maximum);
+    }
+}
+
+/** Allocates a work buffer if it is needed and releases it if it is not.
+  * \param[in,out] ppBuffer The buffer, which is NULL if it is not allocated.
+  * \param[in] needed True if the next image needs the buffer.
+  * \param[out] pAllocated Set to true if a new buffer was allocated, whose contents are undefined. */
+int simDetector::updateWorkBuffer(NDArray **ppBuffer, bool needed, bool *pAllocated)
+{
+    *pAllocated = false;
+    if (!needed) {
+        if (*ppBuffer) (*ppBuffer)->release();
+        *ppBuffer = NULL;
+    } else if (!*ppBuffer) {
+        *ppBuffer = this->pNDArrayPool->alloc(bufferNDims_, bufferDims_, params_.dataType, 0, NULL);
+        if (!*ppBuffer) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:updateWorkBuffer: error allocating work buffer\n",
+                      driverName);
+            return asynError;
+        }
+        *pAllocated = true;
+    }
+    return asynSuccess;
+}
+
+/** Allocates the work buffers and tables that the next image needs, and releases those that it does not need.
+  * This is called by computeArray() once useBackground_ and rampInImage_ are known for the next image.
+  * The pool is thread safe, so this does not need the lock. */
+int simDetector::updateWorkBuffers()
+{
+    bool rampMode = (params_.simMode == SimModeLinearRamp);
+    bool allocated;
+    int status;
+
+    status = updateWorkBuffer(&pBackground_, useBackground_, &allocated);
+    if (status) return status;
+
+    /* A new buffer for the ramp starts it again, unless computeArray() copies the previous image into pRaw_ */
+    status = updateWorkBuffer(&pRamp_, rampMode && useBackground_, &allocated);
+    if (status) return status;
+    if (allocated) params_.dirty |= SimDirtyRamp;
+    status = updateWorkBuffer(&pRaw_, rampMode && !useBackground_ && !(rampInImage_ && pRampImage_), &allocated);
+    if (status) return status;
+    if (allocated && (rampInImage_ || !pRampImage_)) params_.dirty |= SimDirtyRamp;
+
+    /* The tables of the other modes are computed again when the mode changes */
+    if (params_.simMode != SimModePeaks) {
+        std::vector<char>().swap(peakProfile_);
+        std::vector<double>().swap(peakGainVariation_);
+    }
+    if (params_.simMode != SimModeSine) {
+        std::vector<double>().swap(xSine1_);
+        std::vector<double>().swap(xSine2_);
+        std::vector<double>().swap(ySine1_);
+        std::vector<double>().swap(ySine2_);
+        std::vector<double>().swap(xSineRGB1_);
+    }
+    return asynSuccess;
+}
+
+/** Releases all of the work buffers, when the data type or color mode changes */
+void simDetector::releaseWorkBuffers()
+{
+    bool allocated;
+
+    updateWorkBuffer(&pRaw_,        false, &allocated);
+    updateWorkBuffer(&pBackground_, false, &allocated);
+    updateWorkBuffer(&pRamp_,       false, &allocated);
+    if (pRampImage_) pRampImage_->release();
+    pRampImage_ = NULL;
+}
+
+/** Sets SimMemoryUse to the memory used by the work buffers, tables and scratch buffers of the driver,
+  * not counting the images that it publishes or keeps for replay. */
+void simDetector::updateMemoryUse()
+{
+    NDArray *buffers[3] = {pRaw_, pBackground_, pRamp_};
+    NDArrayInfo_t arrayInfo;
+    size_t bytes = 0;
+    int i;
+
+    for (i=0; i<3; i++) {
+        if (!buffers[i]) continue;
+        buffers[i]->getInfo(&arrayInfo);
+        bytes += arrayInfo.totalBytes;
+    }
+    bytes += peakProfile_.capacity() + scratch_.capacity();
+    bytes += sizeof(double) * (peakGainVariation_.capacity() + xSine1_.capacity() + xSine2_.capacity() +
+                               ySine1_.capacity() + ySine2_.capacity() + xSineRGB1_.capacity());
+    setDoubleParam(SimMemoryUse, bytes / (1024. * 1024.));
+}
+
+/** Publishes the next of the images kept for replay rather than computing a new image.
+  * If nothing else holds a reference to the image it is published again as it is.  Otherwise plugins may still be
+  * using it, so a copy is published, and they do not see its frame number and time stamp change.
+  * The caller of this function must have taken the mutex. */
+int simDetector::replayImage()
+{
+    int status = asynSuccess;
+    NDArray *pFrame, *pImage;
+    NDArrayInfo_t arrayInfo;
+    const char* functionName = "replayImage";
+
+    pFrame = replayFrames_[replayIndex_];
+    replayIndex_ = (replayIndex_ + 1) % replayFrames_.size();
+    if (pFrame->getReferenceCount() == 1) {
+        pFrame->reserve();
+        pImage = pFrame;
+    } else {
+        pImage = this->pNDArrayPool->copy(pFrame, NULL, true);
+        if (!pImage) {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                      "%s:%s: error allocating image buffer\n",
+                      driverName, functionName);
+            return(asynError);
+        }
+    }
+
+    if (this->pArrays[0]) this->pArrays[0]->release();
+    this->pArrays[0] = pImage;
+    pImage->getInfo(&arrayInfo);
+    status |= setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
+    status |= setIntegerParam(NDArraySizeX, (int)arrayInfo.xSize);
+    status |= setIntegerParam(NDArraySizeY, (int)arrayInfo.ySize);
+    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: error setting parameters\n",
+                    driverName, functionName);
+    return(status);
+}
+
+/** Template function to add an image to a sum of images, with the kernels selected by SimSIMDKernel.
+  * \param[in,out] pSum The sum, of data type NDUInt32 or NDUInt64.
+  * \param[in] pImage The image, which has count elements like pSum.
+  * \param[in] count The number of elements. */
+template <typename epicsType> void simDetector::accumulateArray(NDArray *pSum, NDArray *pImage, size_t count)
+{
+    const simKernels<epicsType> *pKernels = simGetKernels<epicsType>(params_.kernel);
+
+    if (pSum->dataType == NDUInt64) {
+        pKernels->accumulateUInt64((epicsUInt64 *)pSum->pData, (const epicsType *)pImage->pData, count);
+    } else {
+        pKernels->accumulateUInt32((epicsUInt32 *)pSum->pData, (const epicsType *)pImage->pData, count);
+    }
+}
+
+/** Computes numSubFrames images with computeImage(), each with its own noise, and sums them into one image of data
+  * type sumType, which replaces the last of them in pArrays[0].  Each element is converted to the data type of the
+  * sum before it is added, so negative integers wrap around and floating point values are truncated.  If the size
+  * of the images changes the sum starts again from the next image.  Called with the lock held; it is released while
+  * the images are computed and added.
+  * \param[in] numSubFrames The number of images to sum.
+  * \param[in] sumType The data type of the sum, NDUInt32 or NDUInt64. */
+int simDetector::accumulateImage(int numSubFrames, NDDataType_t sumType)
+{
+    int status = asynSuccess;
+    NDArray *pSum = NULL, *pImage = NULL;
+    NDArrayInfo_t arrayInfo;
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    int count = 0;
+    int i;
+    const char *functionName = "accumulateImage";
+
+    while (count < numSubFrames) {
+        status = computeImage();
+        if (status) break;
+        pImage = this->pArrays[0];
+        if (pSum) {
+            bool fits = (pSum->ndims == pImage->ndims);
+            for (i=0; fits && (i<pImage->ndims); i++) {
+                fits = (pSum->dims[i].size    == pImage->dims[i].size) &&
+                       (pSum->dims[i].offset  == pImage->dims[i].offset) &&
+                       (pSum->dims[i].binning == pImage->dims[i].binning) &&
+                       (pSum->dims[i].reverse == pImage->dims[i].reverse);
+            }
+            if (!fits) {
+                pSum->release();
+                pSum = NULL;
+            }
+        }
+        if (!pSum) {
+            for (i=0; i<pImage->ndims; i++) dims[i] = pImage->dims[i].size;
+            pSum = this->pNDArrayPool->alloc(pImage->ndims, dims, sumType, 0, NULL);
+            if (!pSum) {
+                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                          "%s:%s: error allocating sum buffer\n",
+                          driverName, functionName);
+                status = asynError;
+                break;
+            }
+            for (i=0; i<pImage->ndims; i++) pSum->dims[i] = pImage->dims[i];
+            pSum->getInfo(&arrayInfo);
+            memset(pSum->pData, 0, arrayInfo.totalBytes);
+            count = 0;
+        }
+
+        /* Only simTask() replaces pArrays[0], so the image can be added without holding the lock */
+        pImage->getInfo(&arrayInfo);
+        this->unlock();
+        switch (pImage->dataType) {
+            case NDInt8:
+                accumulateArray<epicsInt8>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDUInt8:
+                accumulateArray<epicsUInt8>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDInt16:
+                accumulateArray<epicsInt16>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDUInt16:
+                accumulateArray<epicsUInt16>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDInt32:
+                accumulateArray<epicsInt32>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDUInt32:
+                accumulateArray<epicsUInt32>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDInt64:
+                accumulateArray<epicsInt64>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDUInt64:
+                accumulateArray<epicsUInt64>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDFloat32:
+                accumulateArray<epicsFloat32>(pSum, pImage, arrayInfo.nElements);
+                break;
+            case NDFloat64:
+                accumulateArray<epicsFloat64>(pSum, pImage, arrayInfo.nElements);
+                break;
+        }
+        this->lock();
+        count++;
+    }
+    if (status) {
+        if (pSum) pSum->release();
+        return(status);
+    }
+
+    /* The sum has the attributes of the last image, and replaces it as the image to publish */
+    pImage->pAttributeList->copy(pSum->pAttributeList);
+    pSum->pAttributeList->add("SubFrames", "Number of images summed", NDAttrInt32, &count);
+    pImage->release();
+    this->pArrays[0] = pSum;
+    pSum->getInfo(&arrayInfo);
+    status = setIntegerParam(NDArraySize, (int)arrayInfo.totalBytes);
+    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: error setting parameters\n",
+                    driverName, functionName);
+    return(status);
+}
+
+/** Publishes an image: stamps it with the frame number, time stamp and attributes and passes it to the plugins.
+  * Called with the lock held.
+  * \param[in] pImage The image to publish.
+  * \param[in] pStartTime The time the acquisition of the image started.
+  * \param[in] numFrames The number of images in pImage if it is a batch made by batchImage(), whose images have
+  *            consecutive frame numbers starting from that of the batch, or 0 for a single image.
+  * \param[in] unlockCallbacks If true the lock is released while the plugins are called. */
+void simDetector::publishImage(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, bool unlockCallbacks)
+{
+    int imageCounter;
+    int numImagesCounter;
+    int arrayCallbacks;
+    epicsUInt64 stageStart, stageEnd;
+    NDArrayInfo_t arrayInfo;
+    const char *functionName = "publishImage";
+
+    /* Get the current parameters */
+    getIntegerParam(NDArrayCounter, &imageCounter);
+    getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+
+    /* Put the frame number and time stamp into the buffer.  A batch has those of its first image. */
+    pImage->uniqueId = imageCounter + 1;
+    pImage->timeStamp = pStartTime->secPastEpoch + pStartTime->nsec / 1.e9;
+    updateTimeStamp(&pImage->epicsTS);
+    if (numFrames == 0) numFrames = 1;
+    imageCounter += numFrames;
+    numImagesCounter += numFrames;
+    setIntegerParam(NDArrayCounter, imageCounter);
+    setIntegerParam(ADNumImagesCounter, numImagesCounter);
+
+    /* Get any attributes that have been defined for this driver */
+    stageStart = epicsMonotonicGet();
+    this->getAttributes(pImage->pAttributeList);
+    stageEnd = epicsMonotonicGet();
+    recordStageTime(SimStageAttributes, stageStart, stageEnd);
+
+    if (arrayCallbacks) {
+        /* Call the NDArray callback */
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: calling imageData callback\n", driverName, functionName);
+        stageStart = stageEnd;
+        if (unlockCallbacks) this->unlock();
+        doCallbacksGenericPointer(pImage, NDArrayData, 0);
+        stageEnd = epicsMonotonicGet();
+        if (unlockCallbacks) this->lock();
+        recordStageTime(SimStageCallbacks, stageStart, stageEnd);
+    }
+    pImage->getInfo(&arrayInfo);
+    updateRates(numFrames, arrayInfo.totalBytes, stageEnd);
+}
+
+/** Sets the status at the end of single or multiple acquisition. Called with the lock held. */
+void simDetector::finishAcquisition()
 {
-    int status = asynSuccess;
-    NDDataType_t dataType;
-    int itemp;
-    int binX, binY, minX, minY, sizeX, sizeY, reverseX, reverseY;
-    int xDim=0, yDim=1, colorDim=-1;
-    int resetImage;
-    int maxSizeX, maxSizeY;
-    int colorMode;
-    int ndims=0;
-    NDDimension_t dimsOut[3];
-    size_t dims[3];
-    NDArrayInfo_t arrayInfo;
-    NDArray *pImage;
-    const char* functionName = "computeImage";
+    const char *functionName = "finishAcquisition";
 
-    /* NOTE: The caller of this function must have taken the mutex */
+    /* First do callback on ADStatus. */
+    updateStageTimes(epicsMonotonicGet(), true);
+    setStringParam(ADStatusMessage, "Waiting for acquisition");
+    setIntegerParam(ADStatus, ADStatusIdle);
+    callParamCallbacks();
 
-    status |= getIntegerParam(ADBinX,         &binX);
-    status |= getIntegerParam(ADBinY,         &binY);
-    status |= getIntegerParam(ADMinX,         &minX);
-    status |= getIntegerParam(ADMinY,         &minY);
-    status |= getIntegerParam(ADSizeX,        &sizeX);
-    status |= getIntegerParam(ADSizeY,        &sizeY);
-    status |= getIntegerParam(ADReverseX,     &reverseX);
-    status |= getIntegerParam(ADReverseY,     &reverseY);
-    status |= getIntegerParam(ADMaxSizeX,     &maxSizeX);
-    status |= getIntegerParam(ADMaxSizeY,     &maxSizeY);
-    status |= getIntegerParam(NDColorMode,    &colorMode);
-    status |= getIntegerParam(NDDataType,     &itemp); dataType = (NDDataType_t)itemp;
-    status |= getIntegerParam(SimResetImage,  &resetImage);
-    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: error getting parameters\n",
-                    driverName, functionName);
+    setIntegerParam(ADAcquire, 0);
+    asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+              "%s:%s: acquisition completed\n", driverName, functionName);
+}
 
-    /* Make sure parameters are consistent, fix them if they are not */
-    if (binX < 1) {
-        binX = 1;
-        status |= setIntegerParam(ADBinX, binX);
-    }
-    if (binY < 1) {
-        binY = 1;
-        status |= setIntegerParam(ADBinY, binY);
-    }
-    if (minX < 0) {
-        minX = 0;
-        status |= setIntegerParam(ADMinX, minX);
-    }
-    if (minY < 0) {
-        minY = 0;
-        status |= setIntegerParam(ADMinY, minY);
-    }
-    if (minX > maxSizeX-1) {
-        minX = maxSizeX-1;
-        status |= setIntegerParam(ADMinX, minX);
-    }
-    if (minY > maxSizeY-1) {
-        minY = maxSizeY-1;
-        status |= setIntegerParam(ADMinY, minY);
-    }
-    if (minX+sizeX > maxSizeX) {
-        sizeX = maxSizeX-minX;
-        status |= setIntegerParam(ADSizeX, sizeX);
+/** Passes an image to publishTask(), waiting while there are already SimQueueSize images in the queue.
+  * Called with the lock held; the lock is released while waiting.
+  * \param[in] pImage The image to publish.  It is reserved here and released by publishTask().
+  * \param[in] pStartTime The time the acquisition of the image started.
+  * \param[in] numFrames The number of images in pImage if it is a batch, 0 if it is a single image.
+  * \param[in] last True if this is the last image of the acquisition.
+  * \param[in] freeRun True if the image was acquired in SimImageFreeRun mode.
+  * \param[in] queueSize The maximum number of images in the queue. */
+void simDetector::queueImage(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, int last, int freeRun,
+                             int queueSize)
+{
+    simQueueMessage_t message;
+    int stalls;
+
+    pImage->reserve();
+    message.pImage = pImage;
+    message.startTime = *pStartTime;
+    message.numFrames = numFrames;
+    message.last = last;
+    message.readoutEnd = readoutEnd_;
+    getDoubleParam(SimSpinTime, &message.spinTime);
+    message.freeRun = freeRun;
+
+    if (epicsMessageQueuePending(queueId_) >= queueSize) {
+        /* The plugins are not keeping up, so generation has to wait for them */
+        getIntegerParam(SimQueueStalls, &stalls);
+        setIntegerParam(SimQueueStalls, stalls+1);
+        if (!freeRun) flushStatus(false);
     }
-    if (minY+sizeY > maxSizeY) {
-        sizeY = maxSizeY-minY;
-        status |= setIntegerParam(ADSizeY, sizeY);
+    this->unlock();
+    while (epicsMessageQueuePending(queueId_) >= queueSize) {
+        epicsEventWait(queueSpaceEventId_);
     }
+    epicsMessageQueueSend(queueId_, &message, sizeof(message));
+    this->lock();
+    setIntegerParam(SimQueueOccupancy, epicsMessageQueuePending(queueId_));
+}
 
-    switch (colorMode) {
-        case NDColorModeMono:
-            ndims = 2;
-            xDim = 0;
-            yDim = 1;
-            break;
-        case NDColorModeRGB1:
-            ndims = 3;
-            colorDim = 0;
-            xDim     = 1;
-            yDim     = 2;
-            break;
-        case NDColorModeRGB2:
-            ndims = 3;
-            colorDim = 1;
-            xDim     = 0;
-            yDim     = 2;
-            break;
-        case NDColorModeRGB3:
-            ndims = 3;
-            colorDim = 2;
-            xDim     = 0;
-            yDim     = 1;
-            break;
+/** Publishes an image or a batch of images, passing it to publishTask() if queueSize > 0, and finishes the
+  * acquisition after the last one.  Called with the lock held.
+  * \param[in] pImage The image or batch to publish.
+  * \param[in] pStartTime The time the acquisition of the image started.
+  * \param[in] numFrames The number of images in pImage if it is a batch, 0 if it is a single image.
+  * \param[in] last True if this is the last image of the acquisition.
+  * \param[in] freeRun True if the image was acquired in SimImageFreeRun mode.
+  * \param[in] queueSize The maximum number of images in the queue, 0 to publish the image in this thread. */
+void simDetector::publishFrames(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, int last, int freeRun,
+                                int queueSize)
+{
+    if (queueSize > 0) {
+        queueImage(pImage, pStartTime, numFrames, last, freeRun, queueSize);
+    } else {
+        publishImage(pImage, pStartTime, numFrames, false);
+        if (last) finishAcquisition();
     }
+}
 
-    if (resetImage) {
-    /* Free the previous raw buffer */
-        if (pRaw_) pRaw_->release();
-        /* Allocate the raw buffer we use to compute images. */
-        dims[xDim] = maxSizeX;
-        dims[yDim] = maxSizeY;
-        if (ndims > 2) dims[colorDim] = 3;
-        pRaw_        = this->pNDArrayPool->alloc(ndims, dims, dataType, 0, NULL);
-        pBackground_ = this->pNDArrayPool->alloc(ndims, dims, dataType, 0, NULL);
-        pRamp_       = this->pNDArrayPool->alloc(ndims, dims, dataType, 0, NULL);
-        pPeak_       = this->pNDArrayPool->alloc(ndims, dims, dataType, 0, NULL);
-        pRaw_->getInfo(&arrayInfo_);
-
-        if (!pRaw_) {
+/** Copies an image into the next frame of the batch pBatch_, so that batchSize images are published together in
+  * one NDArray, which saves the attributes and callbacks of each image.  The batch has the dimensions of the
+  * images and a last dimension of batchSize frames.  If the size or data type of the images has changed the
+  * images already in the batch are published first.  Called with the lock held.
+  * \param[in] pImage The image.
+  * \param[in] pStartTime The time the acquisition of the image started.
+  * \param[in] batchSize The number of images in a batch.
+  * \param[in] freeRun True if the image was acquired in SimImageFreeRun mode.
+  * \param[in] queueSize The maximum number of images in the queue.
+  * \return asynError if the batch could not be allocated, in which case the image must be published alone. */
+int simDetector::batchImage(NDArray *pImage, epicsTimeStamp *pStartTime, int batchSize, int freeRun, int queueSize)
+{
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    NDArrayInfo_t arrayInfo;
+    int i;
+    const char *functionName = "batchImage";
+
+    if (pBatch_) {
+        bool fits = (pBatch_->dataType == pImage->dataType) && (pBatch_->ndims == pImage->ndims + 1);
+        for (i=0; fits && (i<pImage->ndims); i++) {
+            fits = (pBatch_->dims[i].size    == pImage->dims[i].size) &&
+                   (pBatch_->dims[i].offset  == pImage->dims[i].offset) &&
+                   (pBatch_->dims[i].binning == pImage->dims[i].binning) &&
+                   (pBatch_->dims[i].reverse == pImage->dims[i].reverse);
+        }
+        if (!fits) publishBatch(false, freeRun, queueSize);
+    }
+    if (!pBatch_) {
+        for (i=0; i<pImage->ndims; i++) dims[i] = pImage->dims[i].size;
+        dims[pImage->ndims] = batchSize;
+        pBatch_ = this->pNDArrayPool->alloc(pImage->ndims + 1, dims, pImage->dataType, 0, NULL);
+        if (!pBatch_) {
             asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                      "%s:%s: error allocating raw buffer\n",
+                      "%s:%s: error allocating batch buffer\n",
                       driverName, functionName);
-            return(status);
+            return(asynError);
         }
+        for (i=0; i<pImage->ndims; i++) pBatch_->dims[i] = pImage->dims[i];
+        pImage->pAttributeList->copy(pBatch_->pAttributeList);
+        batchStartTime_ = *pStartTime;
+        batchCount_ = 0;
     }
+    pImage->getInfo(&arrayInfo);
+    memcpy((char *)pBatch_->pData + batchCount_ * arrayInfo.totalBytes, pImage->pData, arrayInfo.totalBytes);
+    batchLastTime_ = *pStartTime;
+    batchCount_++;
+    return(asynSuccess);
+}
 
-    switch (dataType) {
-        case NDInt8:
-            status |= computeArray<epicsInt8>(maxSizeX, maxSizeY);
-            break;
-        case NDUInt8:
-            status |= computeArray<epicsUInt8>(maxSizeX, maxSizeY);
-            break;
-        case NDInt16:
-            status |= computeArray<epicsInt16>(maxSizeX, maxSizeY);
-            break;
-        case NDUInt16:
-            status |= computeArray<epicsUInt16>(maxSizeX, maxSizeY);
-            break;
-        case NDInt32:
-            status |= computeArray<epicsInt32>(maxSizeX, maxSizeY);
-            break;
-        case NDUInt32:
-            status |= computeArray<epicsUInt32>(maxSizeX, maxSizeY);
-            break;
-        case NDInt64:
-            status |= computeArray<epicsInt64>(maxSizeX, maxSizeY);
-            break;
-        case NDUInt64:
-            status |= computeArray<epicsUInt64>(maxSizeX, maxSizeY);
-            break;
-        case NDFloat32:
-            status |= computeArray<epicsFloat32>(maxSizeX, maxSizeY);
-            break;
-        case NDFloat64:
-            status |= computeArray<epicsFloat64>(maxSizeX, maxSizeY);
-            break;
-    }
+/** Publishes the images in pBatch_, which may be fewer than the batch size.  Called with the lock held.
+  * Image n of the batch has frame number UniqueId + n, and its time stamp is TimeStamp + n * FrameTimeStep, where
+  * the FrameTimeStep attribute is the mean time between the starts of the images, so that the attributes do not
+  * grow with the batch size.  This is exact for the first and last images, and for the others it differs from
+  * their start time by the jitter of the start of the images.
+  * \param[in] last True if these are the last images of the acquisition.
+  * \param[in] freeRun True if the images were acquired in SimImageFreeRun mode.
+  * \param[in] queueSize The maximum number of images in the queue. */
+void simDetector::publishBatch(int last, int freeRun, int queueSize)
+{
+    double timeStep = 0.;
+
+    if (batchCount_ > 1) timeStep = epicsTimeDiffInSeconds(&batchLastTime_, &batchStartTime_) / (batchCount_ - 1);
+    pBatch_->pAttributeList->add("FrameTimeStep", "Mean time between the starts of the images", NDAttrFloat64,
+                                 &timeStep);
+    pBatch_->dims[pBatch_->ndims - 1].size = batchCount_;
+    publishFrames(pBatch_, &batchStartTime_, batchCount_, last, freeRun, queueSize);
+    pBatch_->release();
+    pBatch_ = NULL;
+    batchCount_ = 0;
+}
 
-    /* Extract the region of interest with binning.
-     * If the entire image is being used (no ROI or binning) that's OK because
-     * convertImage detects that case and is very efficient */
-    pRaw_->initDimension(&dimsOut[xDim], sizeX);
-    pRaw_->initDimension(&dimsOut[yDim], sizeY);
-    if (ndims > 2) pRaw_->initDimension(&dimsOut[colorDim], 3);
-    dimsOut[xDim].binning = binX;
-    dimsOut[xDim].offset  = minX;
-    dimsOut[xDim].reverse = reverseX;
-    dimsOut[yDim].binning = binY;
-    dimsOut[yDim].offset  = minY;
-    dimsOut[yDim].reverse = reverseY;
-    /* We save the most recent image buffer so it can be used in the read() function.
-     * Now release it before getting a new version. */
-    if (this->pArrays[0]) this->pArrays[0]->release();
-    status = this->pNDArrayPool->convert(pRaw_,
-                                         &this->pArrays[0],
-                                         dataType,
-                                         dimsOut);
-    if (status) {
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: error allocating buffer in convert()\n",
-                    driverName, functionName);
-        return(status);
-    }
-    pImage = this->pArrays[0];
-    pImage->getInfo(&arrayInfo);
-    status = asynSuccess;
-    status |= setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
-    status |= setIntegerParam(NDArraySizeX, (int)pImage->dims[xDim].size);
-    status |= setIntegerParam(NDArraySizeY, (int)pImage->dims[yDim].size);
-    status |= setIntegerParam(SimResetImage, 0);
-    if (status) asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                    "%s:%s: error setting parameters\n",
-                    driverName, functionName);
-    return(status);
+/** Waits until publishTask() has published all of the images in the queue.
+  * Called with the lock held; the lock is released while waiting. */
+void simDetector::flushQueue()
+{
+    simQueueMessage_t message;
+
+    message.pImage = NULL;
+    this->unlock();
+    epicsMessageQueueSend(queueId_, &message, sizeof(message));
+    epicsEventWait(flushEventId_);
+    this->lock();
+    setIntegerParam(SimQueueOccupancy, 0);
+    callParamCallbacks();
 }
 
 static void simTaskC(void *drvPvt)
@@ -697,20 +1897,35 @@ static void simTaskC(void *drvPvt)
     pPvt->simTask();
 }
 
-/** This thread calls computeImage to compute new image data and does the callbacks to send it to higher layers.
-  * It implements the logic for single, multiple or continuous acquisition. */
+/** This thread calls computeImage to compute new image data and publishes it to higher layers.
+  * It implements the logic for single, multiple, continuous or free run acquisition.  In free run mode the images
+  * are computed and published back to back, without the shutter, status and parameter callbacks of each image,
+  * and the parameter callbacks are only done when the rates are updated.  In the other modes the parameter
+  * callbacks of each image are done by flushStatus(), at most SimStatusRate times per second.
+  * Each image is read out for SimReadoutTime after its exposure, and the detector is then dead for SimDeadTime.
+  * If SimReadoutOverlap is set the readout is done by publishTask(), so the next exposure starts during it.
+  * If SimSubFrames > 1 each image is the sum of that many images computed during its exposure.
+  * If SimQueueSize is 0 it publishes each image itself before computing the next one.  Otherwise it passes the
+  * images to publishTask() through a queue, so the next image is computed while the plugins process this one. */
 void simDetector::simTask()
 {
     int status = asynSuccess;
-    int imageCounter;
-    int numImages, numImagesCounter;
+    int numImages;
+    int numAcquired=0;
+    int queueSize=0;
+    int batchSize=1;
+    int overlap=0;
+    int subFrames=1, sumType=NDUInt32;
     int imageMode;
-    int arrayCallbacks;
     int acquire=0;
+    int last;
+    int freeRun=0, freeRunning=0;
     NDArray *pImage;
-    double acquireTime, acquirePeriod, delay;
-    epicsTimeStamp startTime, endTime;
-    double elapsedTime;
+    double acquireTime, acquirePeriod, spinTime, readoutTime, deadTime;
+    epicsTimeStamp startTime;
+    epicsUInt64 computeStart, frameStart=0;
+    epicsUInt64 now, deadline=0, exposureEnd=0, exposureTime, period, skipped, ready, late;
+    int missedDeadlines=0;
     const char *functionName = "simTask";
 
     this->lock();
@@ -718,6 +1933,14 @@ void simDetector::simTask()
     while (1) {
         /* If we are not acquiring then wait for a semaphore that is given when acquisition is started */
         if (!acquire) {
+            /* Publish the images that were batched before the acquisition was stopped */
+            if (pBatch_) publishBatch(false, freeRun, queueSize);
+            if (queueSize > 0) {
+                /* Wait for the images of the last acquisition to be published.  A stop that was requested
+                 * while they were being published applies to that acquisition, not to the next one. */
+                flushQueue();
+                epicsEventTryWait(stopEventId_);
+            }
           /* Release the lock while we wait for an event that says acquire has started, then lock again */
             asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
                 "%s:%s: waiting for acquire to start\n", driverName, functionName);
@@ -727,44 +1950,92 @@ void simDetector::simTask()
             acquire = 1;
             setStringParam(ADStatusMessage, "Acquiring data");
             setIntegerParam(ADNumImagesCounter, 0);
+            /* The queue and batch sizes and the sub-frames can only be changed between acquisitions */
+            getIntegerParam(SimQueueSize, &queueSize);
+            getIntegerParam(SimBatchSize, &batchSize);
+            getIntegerParam(SimSubFrames, &subFrames);
+            getIntegerParam(SimSumDataType, &sumType);
+            /* Overlapped readout is done by publishTask(), so it needs the queue */
+            getIntegerParam(SimReadoutOverlap, &overlap);
+            if (overlap && (queueSize < 1)) queueSize = 1;
+            numAcquired = 0;
+            setIntegerParam(SimQueueStalls, 0);
+            clearStageTimes();
+            frameStart = 0;
+            deadline = 0;
+            missedDeadlines = 0;
+            setIntegerParam(SimMissedDeadlines, 0);
+            clearRates();
+            freeRunning = 0;
+            statusUpdateTime_ = 0;
         }
 
         /* We are acquiring. */
         /* Get the current time */
         epicsTimeGetCurrent(&startTime);
+        now = epicsMonotonicGet();
+        /* The first image starts now, and if AcquirePeriod is not 0 each image after it has a deadline
+         * AcquirePeriod after the previous one, so that the delays do not accumulate */
+        if (deadline) {
+            recordStageTime(SimStageStartJitter, deadline, now);
+        } else {
+            deadline = now;
+        }
         getIntegerParam(ADImageMode, &imageMode);
+        freeRun = (imageMode == SimImageFreeRun);
 
         /* Get the exposure parameters */
         getDoubleParam(ADAcquireTime, &acquireTime);
         getDoubleParam(ADAcquirePeriod, &acquirePeriod);
+        getDoubleParam(SimSpinTime, &spinTime);
+        getDoubleParam(SimReadoutTime, &readoutTime);
+        getDoubleParam(SimDeadTime, &deadTime);
+        exposureTime = (acquireTime > 0.) ? (epicsUInt64)(acquireTime * 1.e9) : 0;
 
-        setIntegerParam(ADStatus, ADStatusAcquire);
+        /* In free run mode the status is set and the shutter is opened only for the first image */
+        if (!freeRunning) {
+            setIntegerParam(ADStatus, ADStatusAcquire);
 
-        /* Open the shutter */
-        setShutter(ADShutterOpen);
+            /* Open the shutter */
+            setShutter(ADShutterOpen);
 
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
+            /* Call the callbacks to update any changes */
+            flushStatus(false);
+        }
+        freeRunning = freeRun;
 
         /* Update the image */
-        status = computeImage();
+        computeStart = epicsMonotonicGet();
+        if (frameStart) recordStageTime(SimStageFrame, frameStart, computeStart);
+        frameStart = computeStart;
+        /* If SimSubFrames > 1 the image is the sum of that many images */
+        if (subFrames > 1) {
+            status = accumulateImage(subFrames, (NDDataType_t)sumType);
+        } else {
+            status = computeImage();
+        }
+        recordStageTime(SimStageCompute, computeStart, epicsMonotonicGet());
+        updateStageTimes(computeStart, false);
         if (status) continue;
+        rateSubFrames_ += subFrames;
 
-        /* Simulate being busy during the exposure time.  Use epicsEventWaitWithTimeout so that
-         * manually stopping the acquisition will work */
-        epicsTimeGetCurrent(&endTime);
-        elapsedTime = epicsTimeDiffInSeconds(&endTime, &startTime);
-        delay = acquireTime - elapsedTime;
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                  "%s:%s: delay=%f\n",
-                  driverName, functionName, delay);
-        if (delay <= 0.0) delay = MIN_DELAY;
-        this->unlock();
-        status = epicsEventWaitWithTimeout(stopEventId_, delay);
-        this->lock();
+        /* Simulate being busy during the exposure time, until AcquireTime after the deadline of this image.
+         * waitUntil() returns when the acquisition is stopped, so that manually stopping the acquisition will work.
+         * In free run mode there is no exposure time, so this only checks if the acquisition was stopped. */
+        if (freeRun) {
+            status = epicsEventTryWait(stopEventId_);
+        } else {
+            exposureEnd = deadline + exposureTime;
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                      "%s:%s: delay=%f\n",
+                      driverName, functionName, ((double)exposureEnd - (double)epicsMonotonicGet()) * 1.e-9);
+            this->unlock();
+            status = waitUntil(exposureEnd, spinTime, true);
+            this->lock();
+        }
         if (status == epicsEventWaitOK) {
             acquire = 0;
-            if (imageMode == ADImageContinuous) {
+            if ((imageMode == ADImageContinuous) || freeRun) {
               setIntegerParam(ADStatus, ADStatusIdle);
             } else {
               setIntegerParam(ADStatus, ADStatusAborted);
@@ -772,90 +2043,151 @@ void simDetector::simTask()
             callParamCallbacks();
         }
 
-        /* Close the shutter */
-        setShutter(ADShutterClosed);
+        /* Close the shutter, which stays open between the images in free run mode */
+        if (!freeRun || !acquire) setShutter(ADShutterClosed);
 
         if (!acquire) continue;
 
-        setIntegerParam(ADStatus, ADStatusReadout);
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
+        /* Simulate the readout of the image, which ends SimReadoutTime after the exposure.  With SimReadoutOverlap
+         * publishTask() waits for it, otherwise the image is published after it. */
+        readoutEnd_ = 0;
+        if (!freeRun) {
+            readoutEnd_ = exposureEnd + ((readoutTime > 0.) ? (epicsUInt64)(readoutTime * 1.e9) : 0);
+            setIntegerParam(ADStatus, ADStatusReadout);
+            /* Call the callbacks to update any changes */
+            flushStatus(false);
+            if (!overlap && (readoutEnd_ > epicsMonotonicGet())) {
+                this->unlock();
+                status = waitUntil(readoutEnd_, spinTime, true);
+                this->lock();
+                if (status == epicsEventWaitOK) {
+                    acquire = 0;
+                    if (imageMode == ADImageContinuous) {
+                        setIntegerParam(ADStatus, ADStatusIdle);
+                    } else {
+                        setIntegerParam(ADStatus, ADStatusAborted);
+                    }
+                    callParamCallbacks();
+                    continue;
+                }
+            }
+        }
 
         pImage = this->pArrays[0];
-
-        /* Get the current parameters */
-        getIntegerParam(NDArrayCounter, &imageCounter);
         getIntegerParam(ADNumImages, &numImages);
-        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-        imageCounter++;
-        numImagesCounter++;
-        setIntegerParam(NDArrayCounter, imageCounter);
-        setIntegerParam(ADNumImagesCounter, numImagesCounter);
-
-        /* Put the frame number and time stamp into the buffer */
-        pImage->uniqueId = imageCounter;
-        pImage->timeStamp = startTime.secPastEpoch + startTime.nsec / 1.e9;
-        updateTimeStamp(&pImage->epicsTS);
-
-        /* Get any attributes that have been defined for this driver */
-        this->getAttributes(pImage->pAttributeList);
-
-        if (arrayCallbacks) {
-            /* Call the NDArray callback */
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                      "%s:%s: calling imageData callback\n", driverName, functionName);
-            doCallbacksGenericPointer(pImage, NDArrayData, 0);
+
+        /* See if this is the last image of the acquisition */
+        numAcquired++;
+        last = (imageMode == ADImageSingle) ||
+               ((imageMode == ADImageMultiple) && (numAcquired >= numImages));
+
+        /* If SimBatchSize > 1 the image is added to the batch, which is published when it is full or at the end
+         * of the acquisition.  Otherwise, or if the batch cannot be allocated, the image is published alone. */
+        if ((batchSize > 1) && (batchImage(pImage, &startTime, batchSize, freeRun, queueSize) == asynSuccess)) {
+            if ((batchCount_ >= batchSize) || last) publishBatch(last, freeRun, queueSize);
+        } else {
+            publishFrames(pImage, &startTime, 0, last, freeRun, queueSize);
         }
+        if (last) acquire = 0;
 
-        /* See if acquisition is done */
-        if ((imageMode == ADImageSingle) ||
-            ((imageMode == ADImageMultiple) &&
-             (numImagesCounter >= numImages))) {
+        /* Call the callbacks to update any changes.  They are always done at the end of the acquisition. */
+        if (!freeRun || ratesUpdated_ || !acquire) flushStatus(ratesUpdated_ || !acquire);
 
-            /* First do callback on ADStatus. */
-            setStringParam(ADStatusMessage, "Waiting for acquisition");
-            setIntegerParam(ADStatus, ADStatusIdle);
-            callParamCallbacks();
+        if (!acquire) continue;
 
-            acquire = 0;
-            setIntegerParam(ADAcquire, acquire);
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                      "%s:%s: acquisition completed\n", driverName, functionName);
+        /* The detector is ready for the next image SimDeadTime after the readout of this one, or with
+         * SimReadoutOverlap SimDeadTime after its exposure, but not so early that the next readout would start
+         * before this one ends.  In free run mode it is ready now. */
+        now = epicsMonotonicGet();
+        ready = now;
+        if (!freeRun) {
+            ready = (overlap ? exposureEnd : readoutEnd_) + ((deadTime > 0.) ? (epicsUInt64)(deadTime * 1.e9) : 0);
+            if (overlap && (readoutEnd_ - exposureTime > ready)) ready = readoutEnd_ - exposureTime;
         }
 
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
-
-        /* If we are acquiring then sleep for the acquire period minus elapsed time. */
-        if (acquire) {
-            epicsTimeGetCurrent(&endTime);
-            elapsedTime = epicsTimeDiffInSeconds(&endTime, &startTime);
-            delay = acquirePeriod - elapsedTime;
-            asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
-                      "%s:%s: delay=%f\n",
-                      driverName, functionName, delay);
-            if (delay >= 0.0) {
-                /* We set the status to waiting to indicate we are in the period delay */
-                setIntegerParam(ADStatus, ADStatusWaiting);
-                callParamCallbacks();
-                this->unlock();
-                status = epicsEventWaitWithTimeout(stopEventId_, delay);
-                this->lock();
-                if (status == epicsEventWaitOK) {
-                  acquire = 0;
-                  if (imageMode == ADImageContinuous) {
-                    setIntegerParam(ADStatus, ADStatusIdle);
-                  } else {
-                    setIntegerParam(ADStatus, ADStatusAborted);
-                  }
-                  callParamCallbacks();
+        /* Wait for the deadline of the next image, AcquirePeriod after that of this one.  If AcquirePeriod is 0,
+         * or in free run mode, the next image starts when the detector is ready. */
+        if ((acquirePeriod <= 0.) || freeRun) {
+            deadline = (ready > now) ? ready : 0;
+        } else {
+            period = (epicsUInt64)(acquirePeriod * 1.e9);
+            if (period == 0) period = 1;
+            deadline += period;
+            late = (ready > now) ? ready : now;
+            if (late > deadline) {
+                /* If the deadline has passed the next image starts now, and later images catch up.  If a whole
+                 * period has passed the deadlines that have passed are skipped instead, so that the images keep
+                 * to the grid of deadlines rather than being computed back to back. */
+                if (late - deadline < period) {
+                    missedDeadlines++;
+                } else {
+                    skipped = (late - deadline) / period + 1;
+                    missedDeadlines += (int)skipped;
+                    deadline += skipped * period;
                 }
+                setIntegerParam(SimMissedDeadlines, missedDeadlines);
+            }
+            /* The exposure cannot start before the detector is ready, so then it starts late rather than being
+             * shortened to catch up */
+            if (ready > deadline) deadline = ready;
+        }
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_FLOW,
+                  "%s:%s: delay=%f\n",
+                  driverName, functionName, ((double)deadline - (double)now) * 1.e-9);
+        if (deadline > now) {
+            /* We set the status to waiting to indicate we are in the period delay */
+            setIntegerParam(ADStatus, ADStatusWaiting);
+            flushStatus(false);
+            this->unlock();
+            status = waitUntil(deadline, spinTime, true);
+            this->lock();
+            if (status == epicsEventWaitOK) {
+              acquire = 0;
+              if (imageMode == ADImageContinuous) {
+                setIntegerParam(ADStatus, ADStatusIdle);
+              } else {
+                setIntegerParam(ADStatus, ADStatusAborted);
+              }
+              callParamCallbacks();
             }
         }
     }
 }
 
+static void simPublishTaskC(void *drvPvt)
+{
+    simDetector *pPvt = (simDetector *)drvPvt;
+
+    pPvt->publishTask();
+}
+
+/** This thread publishes the images that simTask() puts in the queue when SimQueueSize > 0.
+  * The plugin callbacks are done in this thread without holding the lock, so plugins that block only delay
+  * the computation of the next image once the queue is full. */
+void simDetector::publishTask()
+{
+    simQueueMessage_t message;
+
+    while (1) {
+        epicsMessageQueueReceive(queueId_, &message, sizeof(message));
+        epicsEventSignal(queueSpaceEventId_);
+        if (!message.pImage) {
+            /* simTask() is waiting for all of the images to be published */
+            epicsEventSignal(flushEventId_);
+            continue;
+        }
+        /* With SimReadoutOverlap the image is read out here while simTask() exposes the next one */
+        waitUntil(message.readoutEnd, message.spinTime, false);
+        this->lock();
+        setIntegerParam(SimQueueOccupancy, epicsMessageQueuePending(queueId_));
+        publishImage(message.pImage, &message.startTime, message.numFrames, true);
+        if (message.last) finishAcquisition();
+        if (!message.freeRun || ratesUpdated_) flushStatus(ratesUpdated_ || message.last);
+        this->unlock();
+        message.pImage->release();
+    }
+}
+
 
 /** Called when asyn clients call pasynInt32->write().
   * This function performs actions for some parameters, including ADAcquire, ADColorMode, etc.
@@ -868,6 +2200,7 @@ asynStatus simDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
     int adstatus;
     int acquiring;
     int imageMode;
+    int dirtyFlags = paramDirtyFlags(function);
     asynStatus status = asynSuccess;
 
     /* Ensure that ADStatus is set correctly before we set ADAcquire.*/
@@ -880,7 +2213,7 @@ asynStatus simDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
       }
       if (!value && acquiring) {
         setStringParam(ADStatusMessage, "Acquisition stopped");
-        if (imageMode == ADImageContinuous) {
+        if ((imageMode == ADImageContinuous) || (imageMode == SimImageFreeRun)) {
           setIntegerParam(ADStatus, ADStatusIdle);
         } else {
           setIntegerParam(ADStatus, ADStatusAborted);
@@ -890,6 +2223,43 @@ asynStatus simDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
     }
     callParamCallbacks();
 
+    /* Limit the number of threads to the supported range */
+    if (function == SimNumThreads) {
+        if (value < 1) value = 1;
+        if (value > MAX_SIM_THREADS) value = MAX_SIM_THREADS;
+    }
+
+    /* Limit the kernel to the instruction sets supported by this CPU */
+    if (function == SimSIMDKernel) {
+        if (value < SimKernelScalar) value = SimKernelScalar;
+        if (value > simKernelsDetect()) value = simKernelsDetect();
+    }
+
+    /* Limit the queue size to the capacity of the message queue */
+    if (function == SimQueueSize) {
+        if (value < 0) value = 0;
+        if (value > MAX_SIM_QUEUE_SIZE) value = MAX_SIM_QUEUE_SIZE;
+    }
+
+    /* A batch size of 1 publishes each image alone */
+    if (function == SimBatchSize) {
+        if (value < 1) value = 1;
+        if (value > MAX_SIM_BATCH_SIZE) value = MAX_SIM_BATCH_SIZE;
+    }
+
+    /* 1 sub-frame turns the summing off, and the sum is either UInt32 or UInt64 */
+    if (function == SimSubFrames) {
+        if (value < 1) value = 1;
+    }
+    if (function == SimSumDataType) {
+        if (value != NDUInt64) value = NDUInt32;
+    }
+
+    /* 0 turns replay off */
+    if ((function == SimReplayFrames) || (function == SimReplayMaxMemory)) {
+        if (value < 0) value = 0;
+    }
+
     /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
      * status at the end, but that's OK */
     status = setIntegerParam(function, value);
@@ -906,14 +2276,12 @@ asynStatus simDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
             /* Send the stop event */
             epicsEventSignal(stopEventId_);
         }
-    } else if ((function == NDDataType) ||
-               (function == NDColorMode) ||
-               (function == SimMode) ||
-               ((function >= SimPeakStartX) && (function <= SimPeakStepY))) {  // This assumes order in simDetector.h!
-        status = setIntegerParam(SimResetImage, 1);
+    } else if ((function >= FIRST_SIM_DETECTOR_PARAM) || dirtyFlags) {
+        /* Changing any of the simulation parameters may change the image */
+        dirty_ |= dirtyFlags;
     } else {
-        /* If this parameter belongs to a base class call its method */
-        if (function < FIRST_SIM_DETECTOR_PARAM) status = ADDriver::writeInt32(pasynUser, value);
+        /* This parameter belongs to a base class call its method */
+        status = ADDriver::writeInt32(pasynUser, value);
     }
 
     /* Do callbacks so higher layers see any changes */
@@ -939,15 +2307,16 @@ asynStatus simDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
 asynStatus simDetector::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 {
     int function = pasynUser->reason;
+    int dirtyFlags = paramDirtyFlags(function);
     asynStatus status = asynSuccess;
 
     /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
      * status at the end, but that's OK */
     status = setDoubleParam(function, value);
 
-    /* Changing any of the simulation parameters requires recomputing the base image */
-    if ((function == ADGain) || (function >= FIRST_SIM_DETECTOR_PARAM)) {
-        status = setIntegerParam(SimResetImage, 1);
+    /* Changing any of the simulation parameters may change the image */
+    if ((function >= FIRST_SIM_DETECTOR_PARAM) || dirtyFlags) {
+        dirty_ |= dirtyFlags;
     } else {
         /* This parameter belongs to a base class call its method */
         status = ADDriver::writeFloat64(pasynUser, value);
@@ -978,12 +2347,58 @@ void simDetector::report(FILE *fp, int details)
 
     fprintf(fp, "Simulation detector %s\n", this->portName);
     if (details > 0) {
-        int nx, ny, dataType;
+        int nx, ny, dataType, numThreads, kernel, queueSize, queueOccupancy, queueStalls, replayFrames;
+        int missedDeadlines, readoutOverlap, subFrames, sumDataType, numWorkers, replayKept;
+        double frameRate, dataRate, readoutTime, deadTime, subFrameRate;
+        static const char *stageNames[SimNumStages] = {"Compute", "Attributes", "Callbacks", "Frame",
+                                                       "StartJitter"};
+        double stats[SimNumStages][4];
+        int stage, i;
+        /* The image thread changes the workers and the replay images with the lock held */
+        this->lock();
         getIntegerParam(ADSizeX, &nx);
         getIntegerParam(ADSizeY, &ny);
         getIntegerParam(NDDataType, &dataType);
+        getIntegerParam(SimNumThreads, &numThreads);
+        getIntegerParam(SimSIMDKernel, &kernel);
+        getIntegerParam(SimQueueSize, &queueSize);
+        getIntegerParam(SimQueueOccupancy, &queueOccupancy);
+        getIntegerParam(SimQueueStalls, &queueStalls);
+        getIntegerParam(SimReplayFrames, &replayFrames);
+        getIntegerParam(SimMissedDeadlines, &missedDeadlines);
+        getDoubleParam(SimFrameRate, &frameRate);
+        getDoubleParam(SimDataRate, &dataRate);
+        getDoubleParam(SimReadoutTime, &readoutTime);
+        getDoubleParam(SimDeadTime, &deadTime);
+        getIntegerParam(SimReadoutOverlap, &readoutOverlap);
+        getIntegerParam(SimSubFrames, &subFrames);
+        getIntegerParam(SimSumDataType, &sumDataType);
+        getDoubleParam(SimSubFrameRate, &subFrameRate);
+        for (stage=0; stage<SimNumStages; stage++) {
+            for (i=0; i<4; i++) {
+                getDoubleParam(FIRST_SIM_STAGE_TIME_PARAM + 4*stage + i, &stats[stage][i]);
+            }
+        }
+        numWorkers = numWorkers_;
+        replayKept = (int)replayFrames_.size();
+        this->unlock();
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        fprintf(fp, "  Threads:           %d (%d workers created)\n", numThreads, numWorkers);
+        fprintf(fp, "  SIMD kernel:       %s\n", simKernelsName((SimKernel_t)kernel));
+        fprintf(fp, "  Queue size:        %d (%d queued, %d stalls)\n", queueSize, queueOccupancy, queueStalls);
+        fprintf(fp, "  Replay frames:     %d (%d kept)\n", replayFrames, replayKept);
+        fprintf(fp, "  Missed deadlines:  %d\n", missedDeadlines);
+        fprintf(fp, "  Rates:             %.1f frames/s, %.1f MB/s\n", frameRate, dataRate);
+        fprintf(fp, "  Readout:           %g s, dead time %g s, overlap %s\n",
+                readoutTime, deadTime, readoutOverlap ? "enabled" : "disabled");
+        fprintf(fp, "  Sub-frames:        %d summed as %s, %.1f sub-frames/s\n",
+                subFrames, (sumDataType == NDUInt64) ? "UInt64" : "UInt32", subFrameRate);
+        fprintf(fp, "  Stage times (ms):       mean       p50       p99       max\n");
+        for (stage=0; stage<SimNumStages; stage++) {
+            fprintf(fp, "    %-16s %9.3f %9.3f %9.3f %9.3f\n",
+                    stageNames[stage], stats[stage][0], stats[stage][1], stats[stage][2], stats[stage][3]);
+        }
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -1010,7 +2425,13 @@ simDetector::simDetector(const char *portName, int maxSizeX, int maxSizeY, NDDat
                0, 0, /* No interfaces beyond those set in ADDriver.cpp */
                0, 1, /* ASYN_CANBLOCK=0, ASYN_MULTIDEVICE=0, autoConnect=1 */
                priority, stackSize),
-      pRaw_(NULL), xSine1_(0), xSine2_(0), ySine1_(0), ySine2_(0)
+      pRaw_(NULL), pImage_(NULL), pBackground_(NULL), useBackground_(false), frameNoise_(false), pRamp_(NULL),
+      bufferNDims_(0), bufferElements_(0),
+      peakFullWidthX_(0), peakFullWidthY_(0),
+      windowMinX_(0), windowMaxX_(0), windowMinY_(0), windowMaxY_(0), bandTask_(SimBandImageRows), computeRows_(NULL),
+      dirty_(SIM_DIRTY_ALL), scratchSize_(0),
+      pRampImage_(NULL), pRampPrevious_(NULL), rampInImage_(false), randomFrame_(0), replayIndex_(0), numWorkers_(0),
+      statusUpdateTime_(0), pBatch_(NULL), batchCount_(0), readoutEnd_(0)
 
 {
     int status = asynSuccess;
@@ -1031,6 +2452,26 @@ simDetector::simDetector(const char *portName, int maxSizeX, int maxSizeY, NDDat
         return;
     }
 
+    /* Create the queue and the epicsEvents for passing images from the simulate task to the publish task */
+    queueId_ = epicsMessageQueueCreate(MAX_SIM_QUEUE_SIZE + 1, sizeof(simQueueMessage_t));
+    if (!queueId_) {
+        printf("%s:%s epicsMessageQueueCreate failure for image queue\n",
+            driverName, functionName);
+        return;
+    }
+    queueSpaceEventId_ = epicsEventCreate(epicsEventEmpty);
+    if (!queueSpaceEventId_) {
+        printf("%s:%s epicsEventCreate failure for queue space event\n",
+            driverName, functionName);
+        return;
+    }
+    flushEventId_ = epicsEventCreate(epicsEventEmpty);
+    if (!flushEventId_) {
+        printf("%s:%s epicsEventCreate failure for flush event\n",
+            driverName, functionName);
+        return;
+    }
+
     createParam(SimGainXString,               asynParamFloat64, &SimGainX);
     createParam(SimGainYString,               asynParamFloat64, &SimGainY);
     createParam(SimGainRedString,             asynParamFloat64, &SimGainRed);
@@ -1063,6 +2504,49 @@ simDetector::simDetector(const char *portName, int maxSizeX, int maxSizeY, NDDat
     createParam(SimYSine2AmplitudeString,     asynParamFloat64, &SimYSine2Amplitude);
     createParam(SimYSine2FrequencyString,     asynParamFloat64, &SimYSine2Frequency);
     createParam(SimYSine2PhaseString,         asynParamFloat64, &SimYSine2Phase);
+    createParam(SimNumThreadsString,          asynParamInt32,   &SimNumThreads);
+    createParam(SimSIMDKernelString,          asynParamInt32,   &SimSIMDKernel);
+    createParam(SimQueueSizeString,           asynParamInt32,   &SimQueueSize);
+    createParam(SimQueueOccupancyString,      asynParamInt32,   &SimQueueOccupancy);
+    createParam(SimQueueStallsString,         asynParamInt32,   &SimQueueStalls);
+    createParam(SimReplayFramesString,        asynParamInt32,   &SimReplayFrames);
+    createParam(SimReplayMaxMemoryString,     asynParamInt32,   &SimReplayMaxMemory);
+    createParam(SimReplayNumFramesString,     asynParamInt32,   &SimReplayNumFrames);
+    createParam(SimNoiseSeedString,           asynParamInt32,   &SimNoiseSeed);
+    createParam(SimNoiseTypeString,           asynParamInt32,   &SimNoiseType);
+    createParam(SimMemoryUseString,           asynParamFloat64, &SimMemoryUse);
+    createParam(SimComputeTimeMeanString,     asynParamFloat64, &SimComputeTimeMean);
+    createParam(SimComputeTimeP50String,      asynParamFloat64, &SimComputeTimeP50);
+    createParam(SimComputeTimeP99String,      asynParamFloat64, &SimComputeTimeP99);
+    createParam(SimComputeTimeMaxString,      asynParamFloat64, &SimComputeTimeMax);
+    createParam(SimAttributesTimeMeanString,  asynParamFloat64, &SimAttributesTimeMean);
+    createParam(SimAttributesTimeP50String,   asynParamFloat64, &SimAttributesTimeP50);
+    createParam(SimAttributesTimeP99String,   asynParamFloat64, &SimAttributesTimeP99);
+    createParam(SimAttributesTimeMaxString,   asynParamFloat64, &SimAttributesTimeMax);
+    createParam(SimCallbacksTimeMeanString,   asynParamFloat64, &SimCallbacksTimeMean);
+    createParam(SimCallbacksTimeP50String,    asynParamFloat64, &SimCallbacksTimeP50);
+    createParam(SimCallbacksTimeP99String,    asynParamFloat64, &SimCallbacksTimeP99);
+    createParam(SimCallbacksTimeMaxString,    asynParamFloat64, &SimCallbacksTimeMax);
+    createParam(SimFrameTimeMeanString,       asynParamFloat64, &SimFrameTimeMean);
+    createParam(SimFrameTimeP50String,        asynParamFloat64, &SimFrameTimeP50);
+    createParam(SimFrameTimeP99String,        asynParamFloat64, &SimFrameTimeP99);
+    createParam(SimFrameTimeMaxString,        asynParamFloat64, &SimFrameTimeMax);
+    createParam(SimStartJitterMeanString,     asynParamFloat64, &SimStartJitterMean);
+    createParam(SimStartJitterP50String,      asynParamFloat64, &SimStartJitterP50);
+    createParam(SimStartJitterP99String,      asynParamFloat64, &SimStartJitterP99);
+    createParam(SimStartJitterMaxString,      asynParamFloat64, &SimStartJitterMax);
+    createParam(SimSpinTimeString,            asynParamFloat64, &SimSpinTime);
+    createParam(SimMissedDeadlinesString,     asynParamInt32,   &SimMissedDeadlines);
+    createParam(SimFrameRateString,           asynParamFloat64, &SimFrameRate);
+    createParam(SimDataRateString,            asynParamFloat64, &SimDataRate);
+    createParam(SimStatusRateString,          asynParamFloat64, &SimStatusRate);
+    createParam(SimBatchSizeString,           asynParamInt32,   &SimBatchSize);
+    createParam(SimReadoutTimeString,         asynParamFloat64, &SimReadoutTime);
+    createParam(SimDeadTimeString,            asynParamFloat64, &SimDeadTime);
+    createParam(SimReadoutOverlapString,      asynParamInt32,   &SimReadoutOverlap);
+    createParam(SimSubFramesString,           asynParamInt32,   &SimSubFrames);
+    createParam(SimSumDataTypeString,         asynParamInt32,   &SimSumDataType);
+    createParam(SimSubFrameRateString,        asynParamFloat64, &SimSubFrameRate);
 
     /* Set some default values for parameters */
     status =  setStringParam (ADManufacturer, "Simulated detector");
@@ -1107,6 +2591,31 @@ simDetector::simDetector(const char *portName, int maxSizeX, int maxSizeY, NDDat
     status |= setIntegerParam(SimPeakNumY, 1);
     status |= setIntegerParam(SimPeakStepX, 1);
     status |= setIntegerParam(SimPeakStepY, 1);
+    status |= setIntegerParam(SimNumThreads, 1);
+    status |= setIntegerParam(SimQueueSize, 0);
+    status |= setIntegerParam(SimQueueOccupancy, 0);
+    status |= setIntegerParam(SimQueueStalls, 0);
+    status |= setIntegerParam(SimReplayFrames, 0);
+    status |= setIntegerParam(SimReplayMaxMemory, 1024);
+    status |= setIntegerParam(SimReplayNumFrames, 0);
+    status |= setIntegerParam(SimNoiseSeed, 0);
+    status |= setIntegerParam(SimNoiseType, SimNoiseFixed);
+    status |= setDoubleParam (SimMemoryUse, 0.);
+    status |= setDoubleParam (SimSpinTime, SIM_DEFAULT_SPIN_TIME);
+    status |= setIntegerParam(SimMissedDeadlines, 0);
+    status |= setDoubleParam (SimStatusRate, 0.);
+    status |= setIntegerParam(SimBatchSize, 1);
+    status |= setDoubleParam (SimReadoutTime, 0.);
+    status |= setDoubleParam (SimDeadTime, 0.);
+    status |= setIntegerParam(SimReadoutOverlap, 0);
+    status |= setIntegerParam(SimSubFrames, 1);
+    status |= setIntegerParam(SimSumDataType, NDUInt32);
+    clearStageTimes();
+    updateStageTimes(0, true);
+    clearRates();
+
+    /* Select the fastest kernels that this CPU supports */
+    status |= setIntegerParam(SimSIMDKernel, simKernelsDetect());
 
     if (status) {
         printf("%s: unable to set camera parameters\n", functionName);
@@ -1124,6 +2633,18 @@ simDetector::simDetector(const char *portName, int maxSizeX, int maxSizeY, NDDat
             driverName, functionName);
         return;
     }
+
+    /* Create the thread that publishes the images when SimQueueSize > 0 */
+    status = (epicsThreadCreate("SimDetPublish",
+                                epicsThreadPriorityMedium,
+                                epicsThreadGetStackSize(epicsThreadStackMedium),
+                                (EPICSTHREADFUNC)simPublishTaskC,
+                                this) == NULL);
+    if (status) {
+        printf("%s:%s epicsThreadCreate failure for publish task\n",
+            driverName, functionName);
+        return;
+    }
 }
 
 /** Configuration command, called directly or from iocsh */
@@ -1,10 +1,158 @@
+#include <vector>
+
 #include <epicsEvent.h>
+#include <epicsMessageQueue.h>
 #include "ADDriver.h"
+#include "simDetectorKernels.h"
 
 #define DRIVER_VERSION      2
 #define DRIVER_REVISION     9
 #define DRIVER_MODIFICATION 0
 
+/* Maximum number of threads that can be used to compute an image */
+#define MAX_SIM_THREADS 64
+
+/* Maximum number of images that can wait to be published */
+#define MAX_SIM_QUEUE_SIZE 100
+
+/* Maximum number of images that can be published together in one NDArray */
+#define MAX_SIM_BATCH_SIZE 1000
+
+/* Image mode in addition to the ADImageMode_t modes, which computes and publishes images back to back with no
+ * exposure or period delays */
+#define SimImageFreeRun (ADImageContinuous + 1)
+
+class simDetector;
+
+/** Parameters used to compute a single image.
+  * These are copied from the parameter library while the driver is locked, so that the image can be computed
+  * without holding the lock. */
+typedef struct {
+    NDDataType_t dataType;
+    int colorMode;
+    int simMode;
+    int dirty;                  /* The SimDirty_t flags of the state that must be recomputed for this image */
+    int numThreads;
+    SimKernel_t kernel;
+    double gain;
+    double gainX;
+    double gainY;
+    double gainRed;
+    double gainGreen;
+    double gainBlue;
+    double offset;
+    double noise;
+    int noiseType;
+    int noiseSeed;
+    int peakStartX;
+    int peakStartY;
+    int peakWidthX;
+    int peakWidthY;
+    int peakNumX;
+    int peakNumY;
+    int peakStepX;
+    int peakStepY;
+    double peakVariation;
+    int xSineOperation;
+    double xSine1Amplitude;
+    double xSine1Frequency;
+    double xSine1Phase;
+    double xSine2Amplitude;
+    double xSine2Frequency;
+    double xSine2Phase;
+    int ySineOperation;
+    double ySine1Amplitude;
+    double ySine1Frequency;
+    double ySine1Phase;
+    double ySine2Amplitude;
+    double ySine2Frequency;
+    double ySine2Phase;
+    /* The geometry of the output image, after computeImage() has checked the region of interest */
+    int binX;
+    int binY;
+    int reverseX;
+    int reverseY;
+    int outSizeX;
+    int outSizeY;
+} simFrameParams_t;
+
+/** State of a worker thread that computes a band of image rows */
+typedef struct {
+    simDetector *pSimDetector;
+    int band;
+    epicsEventId startEventId;
+    epicsEventId doneEventId;
+    int firstRow;
+    int lastRow;
+} simWorker_t;
+
+/** Message passed from simTask() to publishTask() */
+typedef struct {
+    NDArray *pImage;            /* The image to publish, or NULL to flush the queue */
+    epicsTimeStamp startTime;   /* The time the image was started */
+    int numFrames;              /* The number of images in pImage if it is a batch, 0 if it is a single image */
+    int last;                   /* True if this is the last image of the acquisition */
+    int freeRun;                /* True if the image was acquired in SimImageFreeRun mode */
+    epicsUInt64 readoutEnd;     /* The epicsMonotonicGet() time the readout of the image ends */
+    double spinTime;            /* The SimSpinTime for waiting for the readout */
+} simQueueMessage_t;
+
+/** The work done by the bands of computeBands() */
+typedef enum {
+    SimBandImageRows,       /* Compute rows of the output image */
+    SimBandRampRows,        /* Update the linear ramp for the image rows outside the window */
+    SimBandBackgroundRows   /* Compute rows of the background */
+} SimBandTask_t;
+
+/** The state that must be recomputed before the next image because parameters have changed.
+  * Writing SimResetImage sets all of them. */
+typedef enum {
+    SimDirtyBuffers    = 0x01,  /* The data type or color mode: reallocate the buffers and recompute everything */
+    SimDirtyBackground = 0x02,  /* The offset or noise: recompute the background and restart the random numbers */
+    SimDirtyRamp       = 0x04,  /* Restart the linear ramp */
+    SimDirtyPeaks      = 0x08,  /* Recompute the peak profile */
+    SimDirtySine       = 0x10,  /* Restart the sine waves */
+    SimDirtyImage      = 0x20   /* Any other parameter of the image: discard the images kept for replay */
+} SimDirty_t;
+
+#define SIM_DIRTY_ALL 0x3F
+
+/** The stages of acquiring an image that are timed */
+typedef enum {
+    SimStageCompute,        /* computeImage(), which computes the image or copies a replay image */
+    SimStageAttributes,     /* getAttributes() for the image */
+    SimStageCallbacks,      /* The plugin callbacks for the image */
+    SimStageFrame,          /* The time from the start of one image to the start of the next */
+    SimStageStartJitter,    /* How late each image started after its deadline, when AcquirePeriod is not 0 */
+    SimNumStages
+} SimStage_t;
+
+/* The number of recent images whose stage times are used for the statistics */
+#define SIM_STAGE_SAMPLES 256
+
+/** The durations of the last SIM_STAGE_SAMPLES images for one stage */
+typedef struct {
+    double samples[SIM_STAGE_SAMPLES];  /* In ms */
+    int next;                           /* The element of samples for the next duration */
+    int count;                          /* The number of durations in samples */
+} simStageTimes_t;
+
+/** The sequences of random numbers used to compute the images.
+  * Each sequence uses its own range of the counters passed to simRandom(). */
+typedef enum {
+    SimRandomBackground,        /* The noise for each element of the background */
+    SimRandomBackgroundStart,   /* The element at which the background starts in each image */
+    SimRandomPeakVariation      /* The height variation of each peak in each image */
+} SimRandomSequence_t;
+
+/* The counter of element i of a random sequence */
+#define SIM_RANDOM_COUNTER(sequence, i) (((epicsUInt64)(sequence) << 48) + (i))
+
+/* The noise that is computed for each image uses two counters per element, so it uses a different key to keep
+ * its counters separate from the sequences above.  FRAME_COUNTER is the counter of element i of image frame. */
+#define SIM_RANDOM_FRAME_KEY(seed) ((epicsUInt32)(seed) ^ 0x85EBCA6B)
+#define SIM_RANDOM_FRAME_COUNTER(frame, i) (((epicsUInt64)(frame) << 34) + 2*(epicsUInt64)(i))
+
 /** Simulation detector driver; demonstrates most of the features that areaDetector drivers can support. */
 class epicsShareClass simDetector : public ADDriver {
 public:
@@ -18,6 +166,8 @@ public:
     virtual void setShutter(int open);
     virtual void report(FILE *fp, int details);
     void simTask(); /**< Should be private, but gets called from C, so must be public */
+    void workerTask(simWorker_t *pWorker); /**< Should be private, but gets called from C, so must be public */
+    void publishTask(); /**< Should be private, but gets called from C, so must be public */
 
 protected:
     int SimGainX;
@@ -54,30 +204,163 @@ protected:
     int SimYSine2Amplitude;
     int SimYSine2Frequency;
     int SimYSine2Phase;
+    int SimNumThreads;
+    int SimSIMDKernel;
+    int SimQueueSize;
+    int SimQueueOccupancy;
+    int SimQueueStalls;
+    int SimReplayFrames;
+    int SimReplayMaxMemory;
+    int SimReplayNumFrames;
+    int SimNoiseSeed;
+    int SimNoiseType;
+    int SimMemoryUse;
+    int SimComputeTimeMean;
+    #define FIRST_SIM_STAGE_TIME_PARAM SimComputeTimeMean
+    int SimComputeTimeP50;
+    int SimComputeTimeP99;
+    int SimComputeTimeMax;
+    int SimAttributesTimeMean;
+    int SimAttributesTimeP50;
+    int SimAttributesTimeP99;
+    int SimAttributesTimeMax;
+    int SimCallbacksTimeMean;
+    int SimCallbacksTimeP50;
+    int SimCallbacksTimeP99;
+    int SimCallbacksTimeMax;
+    int SimFrameTimeMean;
+    int SimFrameTimeP50;
+    int SimFrameTimeP99;
+    int SimFrameTimeMax;
+    int SimStartJitterMean;
+    int SimStartJitterP50;
+    int SimStartJitterP99;
+    int SimStartJitterMax;
+    int SimSpinTime;
+    int SimMissedDeadlines;
+    int SimFrameRate;
+    int SimDataRate;
+    int SimStatusRate;
+    int SimBatchSize;
+    int SimReadoutTime;
+    int SimDeadTime;
+    int SimReadoutOverlap;
+    int SimSubFrames;
+    int SimSumDataType;
+    int SimSubFrameRate;
 
 private:
+    /** A computeRows() for one data type and color mode */
+    typedef void (simDetector::*computeRowsFunc_t)(int band, int firstRow, int lastRow);
+
     /* These are the methods that are new to this class */
     template <typename epicsType> int computeArray(int sizeX, int sizeY);
     template <typename epicsType> int computeLinearRampArray(int sizeX, int sizeY);
     template <typename epicsType> int computePeaksArray(int sizeX, int sizeY);
     template <typename epicsType> int computeSineArray(int sizeX, int sizeY);
+    template <typename epicsType> computeRowsFunc_t getComputeRows(int colorMode);
+    template <typename epicsType, int colorMode> void computeRows(int band, int firstRow, int lastRow);
+    template <typename epicsType> void computeBackgroundRows(int firstRow, int lastRow);
+    template <typename epicsType, int colorMode> void computeRow(int row, epicsType *pOut, size_t colorStride);
+    template <typename epicsType, int colorMode> void computeLinearRampRows(int firstRow, int lastRow,
+                                                                            epicsType *pData);
+    template <typename epicsType, int colorMode> void computePeaksRow(int row, epicsType *pOut, size_t colorStride);
+    template <typename epicsType, int colorMode> void computeSineRow(int row, epicsType *pOut, size_t colorStride);
+    template <typename epicsType> void copyBackground(epicsType *pOut, size_t start, size_t count);
+    template <int colorMode> int getRowRanges(int row, size_t colorStride, size_t *start, size_t *count,
+                                              size_t *outOffset);
+    void getFrameParams();
+    int updateWorkBuffer(NDArray **ppBuffer, bool needed, bool *pAllocated);
+    int updateWorkBuffers();
+    void releaseWorkBuffers();
+    void updateMemoryUse();
+    void recordStageTime(int stage, epicsUInt64 startTime, epicsUInt64 endTime);
+    void clearStageTimes();
+    void updateStageTimes(epicsUInt64 now, bool force);
+    int waitUntil(epicsUInt64 deadline, double spinTime, bool stoppable);
+    void clearRates();
+    void updateRates(int numFrames, size_t bytes, epicsUInt64 now);
+    void flushStatus(bool force);
+    int paramDirtyFlags(int function);
+    void computeRows(int band, int firstRow, int lastRow);
+    void computeBands(int task);
     int computeImage();
+    template <typename epicsType> void accumulateArray(NDArray *pSum, NDArray *pImage, size_t count);
+    int accumulateImage(int numSubFrames, NDDataType_t sumType);
+    void publishImage(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, bool unlockCallbacks);
+    void finishAcquisition();
+    void queueImage(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, int last, int freeRun, int queueSize);
+    void publishFrames(NDArray *pImage, epicsTimeStamp *pStartTime, int numFrames, int last, int freeRun,
+                       int queueSize);
+    int batchImage(NDArray *pImage, epicsTimeStamp *pStartTime, int batchSize, int freeRun, int queueSize);
+    void publishBatch(int last, int freeRun, int queueSize);
+    void flushQueue();
+    size_t replayCapacity(size_t imageBytes);
+    void releaseReplayFrames();
+    int replayImage();
 
     /* Our data */
     epicsEventId startEventId_;
     epicsEventId stopEventId_;
-    NDArray *pRaw_;
-    NDArray *pBackground_;
+    epicsMessageQueueId queueId_;
+    epicsEventId queueSpaceEventId_;
+    epicsEventId flushEventId_;
+    NDArray *pRaw_;         /* The linear ramp if there is no background, only allocated when it is needed */
+    NDArray *pImage_;  /* The output image being computed */
+    NDArray *pBackground_;  /* The background, only allocated when it is needed */
     bool useBackground_;
-    NDArray *pRamp_;
-    NDArray *pPeak_;
-    NDArrayInfo arrayInfo_;
-    double *xSine1_;
-    double *xSine2_;
-    double *ySine1_;
-    double *ySine2_;
+    bool frameNoise_;  /* True if new noise is computed for each element of each image */
+    NDArray *pRamp_;        /* The linear ramp if there is a background, only allocated when it is needed */
+    int bufferNDims_;       /* The dimensions of the work buffers pRaw_, pBackground_ and pRamp_ */
+    size_t bufferDims_[3];
+    size_t bufferElements_;
+    NDAttributeList imageAttributes_;  /* The attributes that are copied to each image */
+    std::vector<char> peakProfile_;  /* The profile of one peak, peakFullWidthY_ rows of peakFullWidthX_ elements */
+    int peakFullWidthX_;
+    int peakFullWidthY_;
+    std::vector<double> xSine1_;
+    std::vector<double> xSine2_;
+    std::vector<double> ySine1_;
+    std::vector<double> ySine2_;
+    std::vector<double> xSineRGB1_;  /* The X sine waves of the 3 colors of each pixel in RGB1 mode */
     double xSineCounter_;
     double ySineCounter_;
+    simFrameParams_t params_;
+    int sizeX_;
+    int sizeY_;
+    int windowMinX_;  /* The region of the image that is computed is [windowMinX_, windowMaxX_) */
+    int windowMaxX_;
+    int windowMinY_;  /* and [windowMinY_, windowMaxY_) */
+    int windowMaxY_;
+    int bandTask_;
+    computeRowsFunc_t computeRows_;  /* computeRows() for the data type and color mode, selected on reset */
+    int dirty_;  /* The SimDirty_t flags set by parameter writes since the last image was computed */
+    std::vector<char> scratch_;  /* Scratch buffers used by the bands for binning, scratchSize_ bytes each */
+    size_t scratchSize_;
+    NDArray *pRampImage_;     /* The last image in linear ramp mode, if the next one will be computed from it */
+    void *pRampPrevious_;     /* The data that the current image in linear ramp mode is computed from */
+    bool rampInImage_;        /* True if the current image in linear ramp mode is computed from the previous one */
+    int backgroundStart_;
+    epicsUInt64 randomFrame_;  /* The number of images computed since the reset, which selects their random numbers */
+    std::vector<double> peakGainVariation_;
+    std::vector<NDArray *> replayFrames_;  /* The images that are published again in turn in replay mode */
+    size_t replayIndex_;                   /* The next image in replayFrames_ to publish */
+    int numWorkers_;                       /* The worker threads created, only changed with the lock held */
+    simWorker_t workers_[MAX_SIM_THREADS];
+    simStageTimes_t stageTimes_[SimNumStages];
+    epicsUInt64 stageUpdateTime_;  /* The epicsMonotonicGet() time the statistics were last computed */
+    epicsUInt64 rateUpdateTime_;   /* The epicsMonotonicGet() time SimFrameRate, SimDataRate and SimSubFrameRate were
+                                    * last computed */
+    int rateFrames_;               /* The images and bytes published since then */
+    double rateBytes_;
+    double rateSubFrames_;         /* The images computed since then, counting each sub-frame of a sum */
+    bool ratesUpdated_;            /* True if the rates have changed since the last callbacks in free run mode */
+    epicsUInt64 statusUpdateTime_; /* The epicsMonotonicGet() time of the last callbacks of flushStatus() */
+    NDArray *pBatch_;              /* The images that will be published together, NULL if there are none */
+    int batchCount_;               /* The number of images in pBatch_ */
+    epicsTimeStamp batchStartTime_;  /* The time the first image in pBatch_ was started */
+    epicsTimeStamp batchLastTime_;   /* The time the last image in pBatch_ was started */
+    epicsUInt64 readoutEnd_;       /* The epicsMonotonicGet() time the readout of the last image ends */
 };
 
 typedef enum {
@@ -87,6 +370,13 @@ typedef enum {
     SimModeOffsetNoise
 } SimModes_t;
 
+typedef enum {
+    SimNoiseFixed,      /* Uniform noise computed on reset, and shifted by a random number of elements in each image */
+    SimNoiseGaussian,   /* Gaussian noise with standard deviation Noise, computed for each image */
+    SimNoisePoisson     /* Poisson noise of the signal plus Gaussian noise with standard deviation Noise, computed
+                           for each image */
+} SimNoiseTypes_t;
+
 typedef enum {
     SimSineOperationAdd,
     SimSineOperationMultiply
@@ -124,3 +414,46 @@ typedef enum {
 #define SimYSine2AmplitudeString      "SIM_YSINE2_AMPLITUDE"
 #define SimYSine2FrequencyString      "SIM_YSINE2_FREQUENCY"
 #define SimYSine2PhaseString          "SIM_YSINE2_PHASE"
+#define SimNumThreadsString           "SIM_NUM_THREADS"
+#define SimSIMDKernelString           "SIM_SIMD_KERNEL"
+#define SimQueueSizeString            "SIM_QUEUE_SIZE"
+#define SimQueueOccupancyString       "SIM_QUEUE_OCCUPANCY"
+#define SimQueueStallsString          "SIM_QUEUE_STALLS"
+#define SimReplayFramesString         "SIM_REPLAY_FRAMES"
+#define SimReplayMaxMemoryString      "SIM_REPLAY_MAX_MEMORY"
+#define SimReplayNumFramesString      "SIM_REPLAY_NUM_FRAMES"
+#define SimNoiseSeedString            "SIM_NOISE_SEED"
+#define SimNoiseTypeString            "SIM_NOISE_TYPE"
+#define SimMemoryUseString            "SIM_MEMORY_USE"
+#define SimComputeTimeMeanString      "SIM_COMPUTE_TIME_MEAN"
+#define SimComputeTimeP50String       "SIM_COMPUTE_TIME_P50"
+#define SimComputeTimeP99String       "SIM_COMPUTE_TIME_P99"
+#define SimComputeTimeMaxString       "SIM_COMPUTE_TIME_MAX"
+#define SimAttributesTimeMeanString   "SIM_ATTRIBUTES_TIME_MEAN"
+#define SimAttributesTimeP50String    "SIM_ATTRIBUTES_TIME_P50"
+#define SimAttributesTimeP99String    "SIM_ATTRIBUTES_TIME_P99"
+#define SimAttributesTimeMaxString    "SIM_ATTRIBUTES_TIME_MAX"
+#define SimCallbacksTimeMeanString    "SIM_CALLBACKS_TIME_MEAN"
+#define SimCallbacksTimeP50String     "SIM_CALLBACKS_TIME_P50"
+#define SimCallbacksTimeP99String     "SIM_CALLBACKS_TIME_P99"
+#define SimCallbacksTimeMaxString     "SIM_CALLBACKS_TIME_MAX"
+#define SimFrameTimeMeanString        "SIM_FRAME_TIME_MEAN"
+#define SimFrameTimeP50String         "SIM_FRAME_TIME_P50"
+#define SimFrameTimeP99String         "SIM_FRAME_TIME_P99"
+#define SimFrameTimeMaxString         "SIM_FRAME_TIME_MAX"
+#define SimStartJitterMeanString      "SIM_START_JITTER_MEAN"
+#define SimStartJitterP50String       "SIM_START_JITTER_P50"
+#define SimStartJitterP99String       "SIM_START_JITTER_P99"
+#define SimStartJitterMaxString       "SIM_START_JITTER_MAX"
+#define SimSpinTimeString             "SIM_SPIN_TIME"
+#define SimMissedDeadlinesString      "SIM_MISSED_DEADLINES"
+#define SimFrameRateString            "SIM_FRAME_RATE"
+#define SimDataRateString             "SIM_DATA_RATE"
+#define SimStatusRateString           "SIM_STATUS_RATE"
+#define SimBatchSizeString            "SIM_BATCH_SIZE"
+#define SimReadoutTimeString          "SIM_READOUT_TIME"
+#define SimDeadTimeString             "SIM_DEAD_TIME"
+#define SimReadoutOverlapString       "SIM_READOUT_OVERLAP"
+#define SimSubFramesString            "SIM_SUB_FRAMES"
+#define SimSumDataTypeString          "SIM_SUM_DATA_TYPE"
+#define SimSubFrameRateString         "SIM_SUB_FRAME_RATE"
@@ -0,0 +1,543 @@
+/* simDetectorKernels.cpp
+ *
+ * Inner loops used by the simulated area detector to compute images.
+ *
+ * Each kernel is written once as an always-inline template function. On x86-64 with gcc or clang the body is
+ * inlined into a wrapper function compiled for each instruction set (SSE2, AVX2, AVX-512), so the compiler
+ * generates vector code for that instruction set from the same source. All versions therefore produce identical
+ * results, and the version to use is selected at run time from the features of the CPU.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <epicsExport.h>
+
+#include "simDetectorKernels.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+  #define SIM_KERNELS_X86
+  #define SIM_KERNEL_INLINE inline __attribute__((always_inline))
+#else
+  #define SIM_KERNEL_INLINE inline
+#endif
+
+#define SIM_NO_ATTRIBUTES
+
+/* AVX-512 implies FMA.  The Makefile compiles this file with -ffp-contract=off so that the compiler does not fuse
+ * multiplies and adds, and floating point results are rounded the same way for all instruction sets. */
+
+/* Converts a double to epicsType.  Integer types are converted via a signed 32-bit or 64-bit integer, which is what
+ * compilers generate for scalar code on x86-64.  This makes values that are out of range for epicsType wrap around
+ * in the same way for all instruction sets, rather than depending on which vector conversion instructions are used. */
+template <typename epicsType> SIM_KERNEL_INLINE epicsType simConvert(double value)
+{
+    return (epicsType)value;
+}
+template <> SIM_KERNEL_INLINE epicsInt8 simConvert<epicsInt8>(double value)
+{
+    return (epicsInt8)(epicsInt32)value;
+}
+template <> SIM_KERNEL_INLINE epicsUInt8 simConvert<epicsUInt8>(double value)
+{
+    return (epicsUInt8)(epicsInt32)value;
+}
+template <> SIM_KERNEL_INLINE epicsInt16 simConvert<epicsInt16>(double value)
+{
+    return (epicsInt16)(epicsInt32)value;
+}
+template <> SIM_KERNEL_INLINE epicsUInt16 simConvert<epicsUInt16>(double value)
+{
+    return (epicsUInt16)(epicsInt32)value;
+}
+template <> SIM_KERNEL_INLINE epicsUInt32 simConvert<epicsUInt32>(double value)
+{
+    return (epicsUInt32)(epicsInt64)value;
+}
+template <> SIM_KERNEL_INLINE epicsUInt64 simConvert<epicsUInt64>(double value)
+{
+    const double twoTo63 = 9223372036854775808.0;
+
+    if (value < twoTo63) return (epicsUInt64)(epicsInt64)value;
+    return (epicsUInt64)(epicsInt64)(value - twoTo63) ^ ((epicsUInt64)1 << 63);
+}
+
+/* Converts an image element to the type of a sum.  Integers are converted as in C, so negative values wrap around,
+ * and floating point values with simConvert(). */
+template <typename sumType, typename epicsType> SIM_KERNEL_INLINE sumType simWiden(epicsType value)
+{
+    return (sumType)value;
+}
+template <> SIM_KERNEL_INLINE epicsUInt32 simWiden<epicsUInt32, epicsFloat32>(epicsFloat32 value)
+{
+    return simConvert<epicsUInt32>(value);
+}
+template <> SIM_KERNEL_INLINE epicsUInt32 simWiden<epicsUInt32, epicsFloat64>(epicsFloat64 value)
+{
+    return simConvert<epicsUInt32>(value);
+}
+template <> SIM_KERNEL_INLINE epicsUInt64 simWiden<epicsUInt64, epicsFloat32>(epicsFloat32 value)
+{
+    return simConvert<epicsUInt64>(value);
+}
+template <> SIM_KERNEL_INLINE epicsUInt64 simWiden<epicsUInt64, epicsFloat64>(epicsFloat64 value)
+{
+    return simConvert<epicsUInt64>(value);
+}
+
+/* Natural logarithm of a positive normal number.  This and the functions below only use arithmetic, rather than the
+ * math library, so that loops that call them are vectorized and give the same results for all instruction sets. */
+SIM_KERNEL_INLINE double simLog(double x)
+{
+    epicsUInt64 bits, offsetBits;
+    epicsInt32 exponent;
+    double m, s, s2;
+
+    /* x = m * 2^exponent with m in [sqrt(2)/2, sqrt(2)).  Subtracting the bits of sqrt(2)/2 gives the exponent
+     * without a branch, which would stop the loop from being vectorized. */
+    memcpy(&bits, &x, sizeof(bits));
+    offsetBits = bits - 0x3FE6A09E667F3BCDULL;
+    exponent = (epicsInt32)((epicsInt64)offsetBits >> 52);
+    bits -= offsetBits & ((epicsUInt64)0xFFF << 52);
+    memcpy(&m, &bits, sizeof(m));
+    /* log(m) = 2 atanh(s), and |s| < 0.172 */
+    s = (m - 1.0) / (m + 1.0);
+    s2 = s * s;
+    return exponent * 0.69314718055994531 +
+           2.0 * s * (1.0 + s2 * (1.0/3 + s2 * (1.0/5 + s2 * (1.0/7 + s2 * (1.0/9 + s2 * (1.0/11 +
+           s2 * (1.0/13 + s2 * (1.0/15 + s2 * (1.0/17)))))))));
+}
+
+/* Square root of a positive normal number, as x / sqrt(x).  The bit pattern estimate of 1 / sqrt(x) is within 4%,
+ * and each Newton iteration, which needs no division, roughly doubles the number of correct digits. */
+SIM_KERNEL_INLINE double simSqrt(double x)
+{
+    epicsUInt64 bits;
+    double y, halfX = 0.5 * x;
+
+    memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5FE6EB50C7B537A9ULL - (bits >> 1);
+    memcpy(&y, &bits, sizeof(y));
+    y = y * (1.5 - halfX * y * y);
+    y = y * (1.5 - halfX * y * y);
+    y = y * (1.5 - halfX * y * y);
+    y = y * (1.5 - halfX * y * y);
+    return x * y;
+}
+
+/* Sine of x in [-pi/2, pi/2], from its Taylor series */
+SIM_KERNEL_INLINE double simSin(double x)
+{
+    double x2 = x * x;
+
+    return x * (1.0 + x2 * (-1.0/6 + x2 * (1.0/120 + x2 * (-1.0/5040 + x2 * (1.0/362880 + x2 * (-1.0/39916800 +
+               x2 * (1.0/6227020800.0 + x2 * (-1.0/1307674368000.0 + x2 * (1.0/355687428096000.0)))))))));
+}
+
+/* Exponential of x in [-20, 0] */
+SIM_KERNEL_INLINE double simExp(double x)
+{
+    epicsInt32 n;
+    epicsUInt64 bits;
+    double r, scale;
+
+    /* exp(x) = 2^n exp(r) with |r| < ln(2) */
+    n = (epicsInt32)(x * 1.4426950408889634);
+    r = x - n * 0.69314718055994531;
+    bits = (epicsUInt64)(epicsInt64)(n + 1023) << 52;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale * (1.0 + r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120 + r * (1.0/720 +
+                    r * (1.0/5040 + r * (1.0/40320 + r * (1.0/362880 + r * (1.0/3628800 + r * (1.0/39916800 +
+                    r * (1.0/479001600 + r * (1.0/6227020800.0 + r * (1.0/87178291200.0)))))))))))))));
+}
+
+/* Uniform random number in [0, 1) from 64 random bits */
+SIM_KERNEL_INLINE double simUniformBits(epicsUInt64 bits)
+{
+    double value;
+
+    bits = ((epicsUInt64)0x3FF << 52) | (bits >> 12);
+    memcpy(&value, &bits, sizeof(value));
+    return value - 1.0;
+}
+
+/* Normally distributed random number from 64 random bits, by the Box-Muller transform of two 32-bit uniform numbers */
+SIM_KERNEL_INLINE double simGaussianBits(epicsUInt64 bits)
+{
+    epicsUInt64 u1Bits = ((epicsUInt64)0x3FF << 52) | ((bits >> 32) << 20) | ((epicsUInt64)1 << 19);
+    double u1, x, sinX;
+
+    /* u1 = (bits[63:32] + 0.5) / 2^32 is in (0, 1), so its logarithm is finite */
+    memcpy(&u1, &u1Bits, sizeof(u1));
+    u1 -= 1.0;
+    /* x = pi * (u2 - 0.5) for u2 = bits[31:0] / 2^32, and cos(2 pi u2) = -cos(2x) = 2 sin(x)^2 - 1 */
+    x = 3.14159265358979323846 * ((double)(epicsInt32)((epicsUInt32)bits ^ 0x80000000) / 4294967296.0);
+    sinX = simSin(x);
+    return simSqrt(-2.0 * simLog(u1)) * (2.0 * sinX * sinX - 1.0);
+}
+
+/* Means below this are sampled exactly, and larger ones with the normal approximation */
+#define SIM_POISSON_EXACT_MEAN 12.0
+/* The number of terms of the cumulative distribution used for the exact samples.  The probability of a larger value
+ * is below 1e-9. */
+#define SIM_POISSON_TERMS 40
+/* The number of elements that addPoisson() samples together */
+#define SIM_POISSON_BLOCK 64
+
+template <typename epicsType> SIM_KERNEL_INLINE void addConstantBody(epicsType *pData, size_t count, epicsType value)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] += value;
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addArrayBody(epicsType *pData, const epicsType *pIn, size_t count)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] += pIn[i];
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addSineRowBody(epicsType *pData, const double *pX, double y,
+                                                                     double gain, size_t count)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] += simConvert<epicsType>(gain * (y + pX[i]));
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addConstantRGB1Body(epicsType *pData, size_t count,
+                                                                          const epicsType *pValue)
+{
+    epicsType red = pValue[0], green = pValue[1], blue = pValue[2];
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[3*i]   += red;
+        pData[3*i+1] += green;
+        pData[3*i+2] += blue;
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addSineRowRGB1Body(epicsType *pData, const double *pX,
+                                                                         const double *pY, const double *pGain,
+                                                                         size_t count)
+{
+    double yRed = pY[0], yGreen = pY[1], yBlue = pY[2];
+    double gainRed = pGain[0], gainGreen = pGain[1], gainBlue = pGain[2];
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[3*i]   += simConvert<epicsType>(gainRed   * (yRed   + pX[3*i]));
+        pData[3*i+1] += simConvert<epicsType>(gainGreen * (yGreen + pX[3*i+1]));
+        pData[3*i+2] += simConvert<epicsType>(gainBlue  * (yBlue  + pX[3*i+2]));
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addScaledArrayBody(epicsType *pData, const epicsType *pIn,
+                                                                         double scale, size_t count)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] = simConvert<epicsType>((double)pData[i] + scale * (double)pIn[i]);
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addPeakRowBody(epicsType *pData, const epicsType *pIn,
+                                                                     double scale, size_t count)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] += simConvert<epicsType>(scale * (double)pIn[i]);
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addPeakRowRGB1Body(epicsType *pData, const epicsType *pIn,
+                                                                         const double *pScale, size_t count)
+{
+    double scaleRed = pScale[0], scaleGreen = pScale[1], scaleBlue = pScale[2];
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[3*i]   += simConvert<epicsType>(scaleRed   * (double)pIn[i]);
+        pData[3*i+1] += simConvert<epicsType>(scaleGreen * (double)pIn[i]);
+        pData[3*i+2] += simConvert<epicsType>(scaleBlue  * (double)pIn[i]);
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void fillUniformBody(epicsType *pData, size_t count, epicsUInt32 seed,
+                                                                      epicsUInt64 counter, double scale, double offset)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] = simConvert<epicsType>(scale * simUniformBits(simRandom(seed, counter + i)) + offset);
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addGaussianBody(epicsType *pData, size_t count, epicsUInt32 seed,
+                                                                      epicsUInt64 counter, double sigma)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pData[i] = simConvert<epicsType>((double)pData[i] + sigma * simGaussianBits(simRandom(seed, counter + 2*i)));
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addPoissonBody(epicsType *pData, size_t count, epicsUInt32 seed,
+                                                                     epicsUInt64 counter, double sigma)
+{
+    static const double inverse[SIM_POISSON_TERMS+1] = {
+        0, 1.0/1, 1.0/2, 1.0/3, 1.0/4, 1.0/5, 1.0/6, 1.0/7, 1.0/8, 1.0/9, 1.0/10,
+        1.0/11, 1.0/12, 1.0/13, 1.0/14, 1.0/15, 1.0/16, 1.0/17, 1.0/18, 1.0/19, 1.0/20,
+        1.0/21, 1.0/22, 1.0/23, 1.0/24, 1.0/25, 1.0/26, 1.0/27, 1.0/28, 1.0/29, 1.0/30,
+        1.0/31, 1.0/32, 1.0/33, 1.0/34, 1.0/35, 1.0/36, 1.0/37, 1.0/38, 1.0/39, 1.0/40};
+    epicsUInt64 bits[SIM_POISSON_BLOCK];
+    double mean[SIM_POISSON_BLOCK], u[SIM_POISSON_BLOCK], p[SIM_POISSON_BLOCK];
+    double cdf[SIM_POISSON_BLOCK], k[SIM_POISSON_BLOCK];
+    double approx;
+    size_t block, n, i;
+    int j, numSmall;
+
+    for (block=0; block<count; block+=SIM_POISSON_BLOCK) {
+        n = count - block;
+        if (n > SIM_POISSON_BLOCK) n = SIM_POISSON_BLOCK;
+        numSmall = 0;
+        for (i=0; i<n; i++) {
+            mean[i] = (double)pData[block+i];
+            mean[i] = (mean[i] < 0) ? 0 : mean[i];
+            k[i] = 0;
+            bits[i] = simRandom(seed, counter + 2*(block+i));
+            numSmall += (mean[i] < SIM_POISSON_EXACT_MEAN) ? 1 : 0;
+        }
+
+        /* Small means by inversion: the sample is the number of terms of the cumulative distribution that are <= u.
+         * All of the terms are computed, rather than stopping at u, so that the loops have no branches. */
+        if (numSmall > 0) {
+            for (i=0; i<n; i++) {
+                u[i] = simUniformBits(bits[i]);
+                p[i] = simExp((mean[i] < SIM_POISSON_EXACT_MEAN) ? -mean[i] : -SIM_POISSON_EXACT_MEAN);
+                cdf[i] = p[i];
+            }
+            for (j=1; j<=SIM_POISSON_TERMS; j++) {
+                for (i=0; i<n; i++) {
+                    k[i] += (cdf[i] <= u[i]) ? 1.0 : 0.0;
+                    p[i] = p[i] * mean[i] * inverse[j];
+                    cdf[i] += p[i];
+                }
+            }
+        }
+
+        /* Large means by the normal approximation, limited to >= 0 and rounded to the nearest integer.  Adding and
+         * subtracting 2^52 rounds without a call to floor(), which does not vectorize with SSE2. */
+        if (numSmall < (int)n) {
+            for (i=0; i<n; i++) {
+                approx = mean[i] + simSqrt(mean[i]) * simGaussianBits(bits[i]);
+                approx = (approx < 0) ? 0 : approx;
+                approx = (approx + 4503599627370496.0) - 4503599627370496.0;
+                k[i] = (mean[i] < SIM_POISSON_EXACT_MEAN) ? k[i] : approx;
+            }
+        }
+
+        if (sigma == 0) {
+            for (i=0; i<n; i++) {
+                pData[block+i] = simConvert<epicsType>(k[i]);
+            }
+        } else {
+            for (i=0; i<n; i++) {
+                pData[block+i] = simConvert<epicsType>(k[i] +
+                    sigma * simGaussianBits(simRandom(seed, counter + 2*(block+i) + 1)));
+            }
+        }
+    }
+}
+
+template <typename epicsType> SIM_KERNEL_INLINE void addBinnedRowBody(epicsType *pData, size_t outStride,
+                                                                       const epicsType *pIn, ptrdiff_t inStride,
+                                                                       size_t count, int binX)
+{
+    size_t i;
+    int b;
+
+    for (i=0; i<count; i++) {
+        for (b=0; b<binX; b++) {
+            pData[i*outStride] += pIn[((ptrdiff_t)i*binX + b) * inStride];
+        }
+    }
+}
+
+template <typename sumType, typename epicsType> SIM_KERNEL_INLINE void accumulateBody(sumType *pSum,
+                                                                                      const epicsType *pIn,
+                                                                                      size_t count)
+{
+    size_t i;
+
+    for (i=0; i<count; i++) {
+        pSum[i] += simWiden<sumType, epicsType>(pIn[i]);
+    }
+}
+
+/* Defines the wrapper functions for one instruction set */
+#define SIM_DEFINE_KERNELS(suffix, attributes) \
+template <typename epicsType> static attributes \
+void addConstant##suffix(epicsType *pData, size_t count, epicsType value) \
+{ \
+    addConstantBody<epicsType>(pData, count, value); \
+} \
+template <typename epicsType> static attributes \
+void addArray##suffix(epicsType *pData, const epicsType *pIn, size_t count) \
+{ \
+    addArrayBody<epicsType>(pData, pIn, count); \
+} \
+template <typename epicsType> static attributes \
+void addSineRow##suffix(epicsType *pData, const double *pX, double y, double gain, size_t count) \
+{ \
+    addSineRowBody<epicsType>(pData, pX, y, gain, count); \
+} \
+template <typename epicsType> static attributes \
+void addConstantRGB1##suffix(epicsType *pData, size_t count, const epicsType *pValue) \
+{ \
+    addConstantRGB1Body<epicsType>(pData, count, pValue); \
+} \
+template <typename epicsType> static attributes \
+void addSineRowRGB1##suffix(epicsType *pData, const double *pX, const double *pY, const double *pGain, \
+                            size_t count) \
+{ \
+    addSineRowRGB1Body<epicsType>(pData, pX, pY, pGain, count); \
+} \
+template <typename epicsType> static attributes \
+void addScaledArray##suffix(epicsType *pData, const epicsType *pIn, double scale, size_t count) \
+{ \
+    addScaledArrayBody<epicsType>(pData, pIn, scale, count); \
+} \
+template <typename epicsType> static attributes \
+void addPeakRow##suffix(epicsType *pData, const epicsType *pIn, double scale, size_t count) \
+{ \
+    addPeakRowBody<epicsType>(pData, pIn, scale, count); \
+} \
+template <typename epicsType> static attributes \
+void addPeakRowRGB1##suffix(epicsType *pData, const epicsType *pIn, const double *pScale, size_t count) \
+{ \
+    addPeakRowRGB1Body<epicsType>(pData, pIn, pScale, count); \
+} \
+template <typename epicsType> static attributes \
+void fillUniform##suffix(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter, \
+                         double scale, double offset) \
+{ \
+    fillUniformBody<epicsType>(pData, count, seed, counter, scale, offset); \
+} \
+template <typename epicsType> static attributes \
+void addGaussian##suffix(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter, double sigma) \
+{ \
+    addGaussianBody<epicsType>(pData, count, seed, counter, sigma); \
+} \
+template <typename epicsType> static attributes \
+void addPoisson##suffix(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter, double sigma) \
+{ \
+    addPoissonBody<epicsType>(pData, count, seed, counter, sigma); \
+} \
+template <typename epicsType> static attributes \
+void addBinnedRow##suffix(epicsType *pData, size_t outStride, const epicsType *pIn, ptrdiff_t inStride, \
+                          size_t count, int binX) \
+{ \
+    addBinnedRowBody<epicsType>(pData, outStride, pIn, inStride, count, binX); \
+} \
+template <typename epicsType> static attributes \
+void accumulateUInt32##suffix(epicsUInt32 *pSum, const epicsType *pIn, size_t count) \
+{ \
+    accumulateBody<epicsUInt32, epicsType>(pSum, pIn, count); \
+} \
+template <typename epicsType> static attributes \
+void accumulateUInt64##suffix(epicsUInt64 *pSum, const epicsType *pIn, size_t count) \
+{ \
+    accumulateBody<epicsUInt64, epicsType>(pSum, pIn, count); \
+}
+
+#define SIM_KERNEL_TABLE(suffix) \
+    { addConstant##suffix<epicsType>, addArray##suffix<epicsType>, addSineRow##suffix<epicsType>, \
+      addConstantRGB1##suffix<epicsType>, addSineRowRGB1##suffix<epicsType>, \
+      addScaledArray##suffix<epicsType>, addPeakRow##suffix<epicsType>, addPeakRowRGB1##suffix<epicsType>, \
+      fillUniform##suffix<epicsType>, addGaussian##suffix<epicsType>, addPoisson##suffix<epicsType>, \
+      addBinnedRow##suffix<epicsType>, accumulateUInt32##suffix<epicsType>, accumulateUInt64##suffix<epicsType> }
+
+SIM_DEFINE_KERNELS(Scalar, SIM_NO_ATTRIBUTES)
+#ifdef SIM_KERNELS_X86
+SIM_DEFINE_KERNELS(SSE2,   __attribute__((target("sse2"))))
+SIM_DEFINE_KERNELS(AVX2,   __attribute__((target("avx2"))))
+SIM_DEFINE_KERNELS(AVX512, __attribute__((target("avx512f,avx512bw,avx512dq,avx512vl"))))
+#endif
+
+SimKernel_t simKernelsDetect()
+{
+#ifdef SIM_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")  && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl")) {
+        return SimKernelAVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return SimKernelAVX2;
+    }
+    return SimKernelSSE2;
+#else
+    return SimKernelScalar;
+#endif
+}
+
+const char *simKernelsName(SimKernel_t kernel)
+{
+    switch (kernel) {
+        case SimKernelSSE2:
+            return "SSE2";
+        case SimKernelAVX2:
+            return "AVX2";
+        case SimKernelAVX512:
+            return "AVX-512";
+        default:
+            return "Scalar";
+    }
+}
+
+template <typename epicsType> const simKernels<epicsType> *simGetKernels(SimKernel_t kernel)
+{
+    static const simKernels<epicsType> scalarKernels = SIM_KERNEL_TABLE(Scalar);
+#ifdef SIM_KERNELS_X86
+    static const simKernels<epicsType> sse2Kernels   = SIM_KERNEL_TABLE(SSE2);
+    static const simKernels<epicsType> avx2Kernels   = SIM_KERNEL_TABLE(AVX2);
+    static const simKernels<epicsType> avx512Kernels = SIM_KERNEL_TABLE(AVX512);
+
+    switch (kernel) {
+        case SimKernelSSE2:
+            return &sse2Kernels;
+        case SimKernelAVX2:
+            return &avx2Kernels;
+        case SimKernelAVX512:
+            return &avx512Kernels;
+        default:
+            break;
+    }
+#endif
+    return &scalarKernels;
+}
+
+template const simKernels<epicsInt8>    *simGetKernels<epicsInt8>   (SimKernel_t kernel);
+template const simKernels<epicsUInt8>   *simGetKernels<epicsUInt8>  (SimKernel_t kernel);
+template const simKernels<epicsInt16>   *simGetKernels<epicsInt16>  (SimKernel_t kernel);
+template const simKernels<epicsUInt16>  *simGetKernels<epicsUInt16> (SimKernel_t kernel);
+template const simKernels<epicsInt32>   *simGetKernels<epicsInt32>  (SimKernel_t kernel);
+template const simKernels<epicsUInt32>  *simGetKernels<epicsUInt32> (SimKernel_t kernel);
+template const simKernels<epicsInt64>   *simGetKernels<epicsInt64>  (SimKernel_t kernel);
+template const simKernels<epicsUInt64>  *simGetKernels<epicsUInt64> (SimKernel_t kernel);
+template const simKernels<epicsFloat32> *simGetKernels<epicsFloat32>(SimKernel_t kernel);
+template const simKernels<epicsFloat64> *simGetKernels<epicsFloat64>(SimKernel_t kernel);
@@ -0,0 +1,105 @@
+/* simDetectorKernels.h
+ *
+ * Inner loops used by the simulated area detector to compute images.
+ *
+ * The kernels operate on contiguous (unit-stride) arrays. On x86-64 systems each kernel is compiled for several
+ * instruction sets and the fastest one supported by the CPU is selected at run time.
+ *
+ */
+
+#ifndef SIM_DETECTOR_KERNELS_H
+#define SIM_DETECTOR_KERNELS_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <shareLib.h>
+
+/** Instruction sets for which the kernels are compiled */
+typedef enum {
+    SimKernelScalar,
+    SimKernelSSE2,
+    SimKernelAVX2,
+    SimKernelAVX512
+} SimKernel_t;
+
+/** Table of the kernels for one data type */
+template <typename epicsType> struct simKernels {
+    /** pData[i] += value for i in [0, count) */
+    void (*addConstant)(epicsType *pData, size_t count, epicsType value);
+    /** pData[i] += pIn[i] for i in [0, count) */
+    void (*addArray)(epicsType *pData, const epicsType *pIn, size_t count);
+    /** pData[i] += (epicsType)(gain * (y + pX[i])) for i in [0, count) */
+    void (*addSineRow)(epicsType *pData, const double *pX, double y, double gain, size_t count);
+    /** pData[3i+c] += pValue[c] for i in [0, count) and c in [0, 3), for RGB1 pixels */
+    void (*addConstantRGB1)(epicsType *pData, size_t count, const epicsType *pValue);
+    /** pData[3i+c] += (epicsType)(pGain[c] * (pY[c] + pX[3i+c])) for i in [0, count) and c in [0, 3),
+      * for RGB1 pixels */
+    void (*addSineRowRGB1)(epicsType *pData, const double *pX, const double *pY, const double *pGain, size_t count);
+    /** pData[i] = (epicsType)(pData[i] + scale * pIn[i]) for i in [0, count) */
+    void (*addScaledArray)(epicsType *pData, const epicsType *pIn, double scale, size_t count);
+    /** pData[i] += (epicsType)(scale * pIn[i]) for i in [0, count) */
+    void (*addPeakRow)(epicsType *pData, const epicsType *pIn, double scale, size_t count);
+    /** pData[3i+c] += (epicsType)(pScale[c] * pIn[i]) for i in [0, count) and c in [0, 3), for RGB1 pixels */
+    void (*addPeakRowRGB1)(epicsType *pData, const epicsType *pIn, const double *pScale, size_t count);
+    /** pData[i] = (epicsType)(scale * simRandomUniform(seed, counter+i) + offset) for i in [0, count) */
+    void (*fillUniform)(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter,
+                        double scale, double offset);
+    /** pData[i] += sigma * (normal random number from simRandom(seed, counter+2i)) for i in [0, count) */
+    void (*addGaussian)(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter, double sigma);
+    /** pData[i] = Poisson random number with mean pData[i], using counter+2i,
+      * plus sigma * (normal random number from simRandom(seed, counter+2i+1)), for i in [0, count) */
+    void (*addPoisson)(epicsType *pData, size_t count, epicsUInt32 seed, epicsUInt64 counter, double sigma);
+    /** pData[i*outStride] += pIn[(i*binX+b)*inStride] for b in [0, binX), for i in [0, count).
+      * inStride is negative to reverse the row. */
+    void (*addBinnedRow)(epicsType *pData, size_t outStride, const epicsType *pIn, ptrdiff_t inStride,
+                         size_t count, int binX);
+    /** pSum[i] += (epicsUInt32)pIn[i] for i in [0, count) */
+    void (*accumulateUInt32)(epicsUInt32 *pSum, const epicsType *pIn, size_t count);
+    /** pSum[i] += (epicsUInt64)pIn[i] for i in [0, count) */
+    void (*accumulateUInt64)(epicsUInt64 *pSum, const epicsType *pIn, size_t count);
+};
+
+/** Counter-based random number generator (Philox2x32-10, Salmon et al., SC11).
+  * Returns 64 random bits that depend only on the seed and the counter, so any element of a random sequence can be
+  * computed independently of the others, in any order and by any thread. */
+inline epicsUInt64 simRandom(epicsUInt32 seed, epicsUInt64 counter)
+{
+    epicsUInt32 x0 = (epicsUInt32)counter;
+    epicsUInt32 x1 = (epicsUInt32)(counter >> 32);
+    epicsUInt32 key = seed;
+    epicsUInt64 product;
+    int i;
+
+    for (i=0; i<10; i++) {
+        product = (epicsUInt64)0xD256D193 * x0;
+        x0 = (epicsUInt32)(product >> 32) ^ key ^ x1;
+        x1 = (epicsUInt32)product;
+        key += 0x9E3779B9;
+    }
+    return ((epicsUInt64)x0 << 32) | x1;
+}
+
+/** Returns a uniform random number in [0, 1) with 52 random bits.
+  * The bits are put in the mantissa of a number in [1, 2), which needs no integer to floating point conversion. */
+inline double simRandomUniform(epicsUInt32 seed, epicsUInt64 counter)
+{
+    epicsUInt64 bits = ((epicsUInt64)0x3FF << 52) | (simRandom(seed, counter) >> 12);
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value - 1.0;
+}
+
+/** Returns the fastest kernel instruction set supported by this CPU */
+epicsShareFunc SimKernel_t simKernelsDetect();
+
+/** Returns the name of a kernel instruction set */
+epicsShareFunc const char *simKernelsName(SimKernel_t kernel);
+
+/** Returns the table of kernels for one data type and instruction set.
+  * If the instruction set is not available on this system the scalar kernels are returned. */
+template <typename epicsType> epicsShareFunc const simKernels<epicsType> *simGetKernels(SimKernel_t kernel);
+
+#endif